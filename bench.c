@@ -0,0 +1,367 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#define popen  _popen
+#define pclose _pclose
+#define TOOL(name)  name ".exe"
+#define NULLDEV     "nul"
+#else
+#define TOOL(name)  "./" name ".exe"
+#define NULLDEV     "/dev/null"
+#endif
+
+// benchmark for the dither tools, every stage is timed on generated and bundled
+// images and reported as csv (or json lines with --json), one row per stage.
+// stages printing their own timing are parsed from the tool output, the others
+// are timed around the process.
+
+#pragma pack(1)
+typedef struct {
+    uint16_t  bfType;
+    uint32_t  bfSize;
+    uint16_t  bfReserved1;
+    uint16_t  bfReserved2;
+    uint32_t  bfOffBits;
+    uint32_t  biSize;
+    uint32_t  biWidth;
+    uint32_t  biHeight;
+    uint16_t  biPlanes;
+    uint16_t  biBitCount;
+    uint32_t  biCompression;
+    uint32_t  biSizeImage;
+    uint32_t  biXPelsPerMeter;
+    uint32_t  biYPelsPerMeter;
+    uint32_t  biClrUsed;
+    uint32_t  biClrImportant;
+} BMPFILEHEADER;
+#pragma pack()
+
+#define BENCH_IMAGE    "bench-image.bmp"
+#define BENCH_PACK     "bench-pack.bmp"
+#define BENCH_PALETTE  "bench-palette.pal"
+
+static int g_json = 0;
+static int g_runs = 3;
+static int g_pals = 0;
+
+static double get_time_ms(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, tick;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&tick);
+    return (double)tick.QuadPart * 1000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+//++ synthetic images
+static uint32_t rand_next(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static int clamp8(int v)
+{
+    return v < 0 ? 0 : v < 255 ? v : 255;
+}
+
+static void gen_pixel(char *type, int x, int y, int w, int h, uint32_t *seed, uint8_t *p)
+{
+    double fx = (double)x / w, fy = (double)y / h, v;
+
+    if (strcmp(type, "gradient") == 0) {
+        p[0] = 255 * fx;
+        p[1] = 255 * fy;
+        p[2] = 255 * (fx + fy) / 2;
+    } else if (strcmp(type, "noise") == 0) {
+        p[0] = rand_next(seed);
+        p[1] = rand_next(seed);
+        p[2] = rand_next(seed);
+    } else {
+        // photo like, smooth shapes of a few hues with some grain
+        v    = sin(fx * 7.0 + sin(fy * 5.0)) * cos(fy * 4.0 - fx * 2.0);
+        p[0] = clamp8(128 + 90 * v + 30 * sin(fy * 13.0) + (int)(rand_next(seed) % 17) - 8);
+        p[1] = clamp8(110 + 70 * cos(fx * 9.0 - v) + (int)(rand_next(seed) % 17) - 8);
+        p[2] = clamp8( 90 + 80 * sin((fx + fy) * 6.0 + v) + (int)(rand_next(seed) % 17) - 8);
+    }
+}
+
+static int gen_bmp(char *file, char *type, int w, int h)
+{
+    BMPFILEHEADER header = {0};
+    FILE         *fp;
+    uint8_t      *line;
+    uint32_t      seed   = 1;
+    int           stride = (w * 3 + 3) & ~3;
+    int           x, y;
+
+    fp   = fopen(file, "wb");
+    line = calloc(1, stride);
+    if (!fp || !line) {
+        if (fp) fclose(fp);
+        free(line);
+        return -1;
+    }
+    header.bfType     = ('B' << 0) | ('M' << 8);
+    header.bfSize     = sizeof(header) + stride * h;
+    header.bfOffBits  = sizeof(header);
+    header.biSize     = 40;
+    header.biWidth    = w;
+    header.biHeight   = h;
+    header.biPlanes   = 1;
+    header.biBitCount = 24;
+    header.biSizeImage= stride * h;
+    fwrite(&header, sizeof(header), 1, fp);
+    for (y=h-1; y>=0; y--) {
+        for (x=0; x<w; x++) gen_pixel(type, x, y, w, h, &seed, line + x * 3);
+        fwrite(line, stride, 1, fp);
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+static int bmp_size(char *file, int *w, int *h)
+{
+    BMPFILEHEADER header = {0};
+    FILE         *fp     = fopen(file, "rb");
+    if (!fp) return -1;
+    if (fread(&header, sizeof(header), 1, fp) != 1) header.biBitCount = 0;
+    fclose(fp);
+    *w = header.biWidth;
+    *h = header.biHeight;
+    return header.biBitCount == 24 ? 0 : -1;
+}
+
+static int copy_file(char *dst, char *src)
+{
+    char   buf[65536];
+    FILE  *fpin  = fopen(src, "rb");
+    FILE  *fpout = fpin ? fopen(dst, "wb") : NULL;
+    size_t n;
+    if (fpin && fpout) {
+        while ((n = fread(buf, 1, sizeof(buf), fpin)) > 0) fwrite(buf, 1, n, fpout);
+    }
+    if (fpin ) fclose(fpin );
+    if (fpout) fclose(fpout);
+    return fpin && fpout ? 0 : -1;
+}
+//-- synthetic images
+
+//++ stage timing
+// run cmd and return the ms printed after key in its output (after the last comma
+// if there is one), or the process time if key is NULL
+static double run_stage(char *cmd, char *key)
+{
+    char    line[1024];
+    FILE   *fp;
+    double  tick, ms = -1;
+    char   *p;
+
+    tick = get_time_ms();
+    fp   = popen(cmd, "r");
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (key && strncmp(line, key, strlen(key)) == 0) {
+            p  = strrchr(line, ',');
+            ms = atof(p ? p + 1 : line + strlen(key));
+        }
+    }
+    if (pclose(fp) != 0) return -1;
+    return key ? ms : get_time_ms() - tick;
+}
+
+static void report(char *image, char *content, int w, int h, char *stage, double ms)
+{
+    double mpix = ms > 0 ? (double)w * h / ms / 1000 : 0;
+    if (ms < 0) {
+        fprintf(stderr, "bench: stage %s failed on %s\n", stage, image);
+        return;
+    }
+    if (g_json) {
+        printf("{\"image\":\"%s\",\"content\":\"%s\",\"width\":%d,\"height\":%d,\"stage\":\"%s\",\"ms\":%.3f,\"mpix_s\":%.3f}\n",
+            image, content, w, h, stage, ms, mpix);
+    } else {
+        printf("%s,%s,%d,%d,%s,%.3f,%.3f\n", image, content, w, h, stage, ms, mpix);
+    }
+    fflush(stdout);
+}
+
+// best of g_runs
+static double time_stage(char *cmd, char *key)
+{
+    double best = -1, ms;
+    int    i;
+    for (i=0; i<g_runs; i++) {
+        ms = run_stage(cmd, key);
+        if (ms < 0) return -1;
+        best = (best < 0 || ms < best) ? ms : best;
+    }
+    return best;
+}
+
+static void bench_image(char *name, char *content, char *file)
+{
+    char cmd[1024];
+    int  w, h;
+
+    if (bmp_size(file, &w, &h) < 0) {
+        fprintf(stderr, "bench: skip %s, not a 24bit bmp\n", file);
+        return;
+    }
+
+    // palette build, 256 colors from the image itself, used by the stages below
+    snprintf(cmd, sizeof(cmd), "%s -p %s 256 --stats 2>&1 > %s", TOOL("palette"), file, BENCH_PALETTE);
+    report(name, content, w, h, "palette", time_stage(cmd, "stats: build: "));
+    snprintf(cmd, sizeof(cmd), "%s -p %s 256 --wu --stats 2>&1 > %s", TOOL("palette"), file, NULLDEV);
+    report(name, content, w, h, "palette_wu", time_stage(cmd, "stats: build: "));
+
+    // lookup structure build
+    snprintf(cmd, sizeof(cmd), "%s %s %s --lut 6 --exact nodither --stream", TOOL("dither"), file, BENCH_PALETTE);
+    report(name, content, w, h, "lut_build", time_stage(cmd, "lut build:"));
+
+    // error diffusion, and the pure palette mapping
+    snprintf(cmd, sizeof(cmd), "%s %s %s", TOOL("dither"), file, BENCH_PALETTE);
+    report(name, content, w, h, "dither", time_stage(cmd, "dither: "));
+    snprintf(cmd, sizeof(cmd), "%s %s %s --lut 6 --exact", TOOL("dither"), file, BENCH_PALETTE);
+    report(name, content, w, h, "dither_lut", time_stage(cmd, "dither: "));
+    snprintf(cmd, sizeof(cmd), "%s %s %s nodither", TOOL("dither"), file, BENCH_PALETTE);
+    report(name, content, w, h, "quantize", time_stage(cmd, "dither: "));
+
+    // 4-bit packing, the tool converts in place so it works on a copy
+    snprintf(cmd, sizeof(cmd), "%s %s > %s", TOOL("bmp24tobmp4"), BENCH_PACK, NULLDEV);
+    if (copy_file(BENCH_PACK, file) == 0) {
+        report(name, content, w, h, "pack4", run_stage(cmd, NULL));
+    }
+}
+//-- stage timing
+
+//++ palette engines
+// build time (best of g_runs) and mean squared error of a palette engine
+static int run_palette(char *cmd, double *ms, double *mse)
+{
+    char   line[1024];
+    FILE  *fp;
+    double t;
+    int    i;
+
+    for (*ms=-1,*mse=-1,i=0; i<g_runs; i++) {
+        fp = popen(cmd, "r");
+        if (!fp) return -1;
+        for (t=-1; fgets(line, sizeof(line), fp); ) {
+            if (strncmp(line, "stats: build: ", 14) == 0) t    = atof(line + 14);
+            if (strncmp(line, "mse: "         ,  5) == 0) *mse = atof(line + 5);
+        }
+        if (pclose(fp) != 0 || t < 0 || *mse < 0) return -1;
+        *ms = *ms < 0 || t < *ms ? t : *ms;
+    }
+    return 0;
+}
+
+// every engine at 16 and 256 colors, the octree per pixel and from the histogram, and wu
+static void bench_palettes(char *name, char *content, char *file)
+{
+    static char *engines[][2] = {
+        { "octree"     , ""              },
+        { "octree_hist", "--hist 8"      },
+        { "wu"         , "--wu"          },
+        { "wu_hist"    , "--wu --hist 5" },
+    };
+    static int colors[] = { 16, 256 };
+    char   cmd[1024];
+    double ms, mse;
+    int    w, h, i, j;
+
+    if (bmp_size(file, &w, &h) < 0) {
+        fprintf(stderr, "bench: skip %s, not a 24bit bmp\n", file);
+        return;
+    }
+    for (j=0; j<(int)(sizeof(colors)/sizeof(colors[0])); j++) {
+        for (i=0; i<(int)(sizeof(engines)/sizeof(engines[0])); i++) {
+            snprintf(cmd, sizeof(cmd), "%s -p %s %d %s --stats --mse 2>&1 > %s", TOOL("palette"), file, colors[j], engines[i][1], NULLDEV);
+            if (run_palette(cmd, &ms, &mse) < 0) {
+                fprintf(stderr, "bench: engine %s failed on %s\n", engines[i][0], name);
+                continue;
+            }
+            if (g_json) {
+                printf("{\"image\":\"%s\",\"content\":\"%s\",\"width\":%d,\"height\":%d,\"engine\":\"%s\",\"colors\":%d,\"ms\":%.3f,\"mse\":%.3f}\n",
+                    name, content, w, h, engines[i][0], colors[j], ms, mse);
+            } else {
+                printf("%s,%s,%d,%d,%s,%d,%.3f,%.3f\n", name, content, w, h, engines[i][0], colors[j], ms, mse);
+            }
+            fflush(stdout);
+        }
+    }
+}
+//-- palette engines
+
+int main(int argc, char *argv[])
+{
+    static char *contents[] = { "gradient", "noise", "photo" };
+    static char *bundled [] = { "lena.bmp", "yale32-B.bmp", "yale96-B.bmp" };
+    char  sizes[256] = "256,1024,2048";
+    char  name [64];
+    char  dst  [64];
+    char *p;
+    int   size, i;
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            g_json = 1;
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            g_runs = atoi(argv[++i]);
+            g_runs = g_runs > 1 ? g_runs : 1;
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            snprintf(sizes, sizeof(sizes), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--palettes") == 0) {
+            g_pals = 1;
+        } else {
+            printf("usage: bench [--json] [--runs N] [--sizes 256,1024,2048] [--palettes]\n");
+            return 0;
+        }
+    }
+    if (!g_json) printf(g_pals ? "image,content,width,height,engine,colors,ms,mse\n" : "image,content,width,height,stage,ms,mpix_s\n");
+
+    for (p=sizes; *p; ) {
+        size = atoi(p);
+        for (i=0; size>0 && i<(int)(sizeof(contents)/sizeof(contents[0])); i++) {
+            snprintf(name, sizeof(name), "%s-%d", contents[i], size);
+            if (gen_bmp(BENCH_IMAGE, contents[i], size, size) == 0) {
+                if (g_pals) bench_palettes(name, contents[i], BENCH_IMAGE);
+                else        bench_image   (name, contents[i], BENCH_IMAGE);
+            }
+        }
+        while (*p && *p != ',') p++;
+        while (*p == ',') p++;
+    }
+
+    for (i=0; i<(int)(sizeof(bundled)/sizeof(bundled[0])); i++) {
+        // outputs are written next to the input, so bench a copy
+        snprintf(dst, sizeof(dst), "bench-%s", bundled[i]);
+        if (copy_file(dst, bundled[i]) == 0) {
+            if (g_pals) bench_palettes(bundled[i], "bundled", dst);
+            else        bench_image   (bundled[i], "bundled", dst);
+            remove(dst);
+        }
+    }
+
+    remove(BENCH_IMAGE);
+    remove(BENCH_PACK);
+    remove(BENCH_PALETTE);
+    remove("dither-" BENCH_IMAGE);
+    for (i=0; i<(int)(sizeof(bundled)/sizeof(bundled[0])); i++) {
+        snprintf(dst, sizeof(dst), "dither-bench-%s", bundled[i]);
+        remove(dst);
+    }
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include "nearest.h"
+#include "mapfile.h"
 
 /* BMP Ͷ */
 typedef struct {
@@ -86,7 +89,38 @@ static int bmp_load(BMP *pb, char *file)
     return pb->pdata ? 0 : -1;
 }
 
-static int bmp_save(BMP *pb, char *file)
+// map a 24bit bmp read only, pdata points at the top row inside the mapping and
+// the stride is negative for the usual bottom-up file, no pixel is copied
+static int bmp_map(BMP *pb, MAPFILE *mf, char *file)
+{
+    BMPFILEHEADER header;
+    int64_t       size;
+
+    if (mapfile_open(mf, file) < 0) return -1;
+    if (mf->size < (int64_t)sizeof(header)) goto failed;
+    memcpy(&header, mf->data, sizeof(header));
+    if (header.biBitCount != 24 || header.biCompression != 0 || (int32_t)header.biWidth <= 0 || header.biHeight == 0) goto failed;
+    pb->width  = header.biWidth;
+    pb->height = abs((int32_t)header.biHeight);
+    pb->cdepth = 24;
+    pb->stride = (pb->width * 3 + 3) & ~3;
+    size = (int64_t)pb->stride * pb->height;
+    if (header.bfOffBits + size > mf->size) goto failed;
+    if ((int32_t)header.biHeight < 0) { // top-down
+        pb->pdata  = mf->data + header.bfOffBits;
+    } else {
+        pb->pdata  = mf->data + header.bfOffBits + size - pb->stride;
+        pb->stride = -pb->stride;
+    }
+    return 0;
+
+failed:
+    mapfile_close(mf);
+    return -1;
+}
+
+// pal is the colour table, 1 << cdepth entries of 0x00RRGGBB
+static int bmp_save(BMP *pb, char *file, uint32_t *pal)
 {
     BMPFILEHEADER header = {0};
     FILE         *fp     = NULL;
@@ -109,7 +143,7 @@ static int bmp_save(BMP *pb, char *file)
     fp = fopen(file, "wb");
     if (fp) {
         fwrite(&header, sizeof(header), 1, fp);
-        fwrite(DEF_PAL_DATA,  palbytes, 1, fp);
+        fwrite(pal, palbytes, 1, fp);
         pdata = (uint8_t*)pb->pdata + pb->stride * pb->height;
         for (i=0; i<pb->height; i++) {
             pdata -= pb->stride;
@@ -121,64 +155,148 @@ static int bmp_save(BMP *pb, char *file)
     return fp ? 0 : -1;
 }
 
-static void bmp_getpixel_24(BMP *pb, int x, int y, int *r, int *g, int *b)
+// the palette is kept as 0x00RRGGBB, the byte order of bmp pixels and colour
+// table entries, a .pal file lists r g b in the same order dither uses them
+static int load_pal(uint32_t *pal, char *file)
 {
-    uint8_t *pbyte = (uint8_t*)pb->pdata;
-    if (x >= pb->width || y >= pb->height) {
-        *r = *g = *b = 0;
-        return;
+    FILE *fp = fopen(file, "rb");
+    int   r, g, b, n = 0;
+    if (!fp) return -1;
+    while (n < 256 && fscanf(fp, "%d %d %d", &r, &g, &b) == 3) {
+        pal[n++] = ((b & 0xFF) << 16) | ((g & 0xFF) << 8) | (r & 0xFF);
     }
-    *b = pbyte[x * (pb->cdepth / 8) + 0 + y * pb->stride];
-    *g = pbyte[x * (pb->cdepth / 8) + 1 + y * pb->stride];
-    *r = pbyte[x * (pb->cdepth / 8) + 2 + y * pb->stride];
+    fclose(fp);
+    return n;
 }
 
-static void bmp_setpixel_4(BMP *pb, int x, int y, int c)
+// pack 8 indices, one per byte with the first pixel in the low byte, to cdepth
+// bits each, first pixel in the high bits of the first byte. every step merges
+// neighbour bytes into one with a shift and squeezes the result together.
+static uint64_t pack8(uint64_t v, int cdepth)
 {
-    if (x >= pb->width || y >= pb->height) return;
-    int offset_byte = y * pb->stride + x * pb->cdepth / 8;
-    int offset_bit  = 4 - x * pb->cdepth % 8;
-    pb->pdata[offset_byte] &= ~(0xF << offset_bit);
-    pb->pdata[offset_byte] |=  (c   << offset_bit);
+    int s;
+    for (s=cdepth; s<8; s*=2) {
+        v = ((v & 0x00FF00FF00FF00FFull) << s) | ((v >> 8) & 0x00FF00FF00FF00FFull);
+        v = (v | (v >>  8)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v >> 16)) & 0x00000000FFFFFFFFull;
+    }
+    return v;
 }
 
-static int color_dist(int r1, int g1, int b1, int r2, int g2, int b2)
+// indices of a row, padded with zeros to a multiple of 8, packed 8 pixels per word
+static void pack_row(const uint8_t *idx, uint8_t *dst, int width, int cdepth)
 {
-    return (r1 - r2) * (r1 - r2) + (g1 - g2) * (g1 - g2) + (b1 - b2) * (b1 - b2);
+    uint64_t v;
+    int      x;
+    if (cdepth == 8) {
+        memcpy(dst, idx, width);
+        return;
+    }
+    for (x=0; x<width; x+=8, dst+=cdepth) {
+        memcpy(&v, idx + x, 8); // little endian
+        v = pack8(v, cdepth);
+        memcpy(dst, &v, cdepth);
+    }
 }
 
-static int find_color(uint32_t *pal, int n, int r, int g, int b)
+// map every pixel through the precomputed table, then pack the row
+static int bmp24tobmpn(BMP *dst, BMP *src, uint32_t *pal, int palsize)
 {
-    int minidx = 0, mindist = 0x7FFFFFFF, curdist, i;
-    for (i=0; i<n; i++) {
-        curdist = color_dist(r, g, b, (pal[i] >> 16) & 0xFF, (pal[i] >> 8) & 0xFF, (pal[i] >> 0) & 0xFF);
-        if (curdist < mindist) mindist = curdist, minidx = i;
+    NEAREST  near;
+    LUT      lut = {0};
+    uint8_t  bytes[256 * 3];
+    uint8_t *idx, *p;
+    int      i, x, y;
+
+    for (i=0; i<palsize; i++) {
+        bytes[i * 3 + 0] = (pal[i] >>  0) & 0xFF;
+        bytes[i * 3 + 1] = (pal[i] >>  8) & 0xFF;
+        bytes[i * 3 + 2] = (pal[i] >> 16) & 0xFF;
+    }
+    nearest_init(&near, bytes, palsize, NEAREST_AUTO);
+    idx = calloc(1, (src->width + 7) & ~7);
+    if (!idx || lut_create(&lut, &near, 5, 1) < 0) {
+        free(idx);
+        return -1;
     }
-    return minidx;
-}
 
-static void bmp24tobmp4(BMP *bmp4, BMP *bmp24)
-{
-    int i, j;
-    for (i=0; i<bmp24->height; i++) {
-        for (j=0; j<bmp24->width; j++) {
-            int r, g, b;
-            bmp_getpixel_24(bmp24, j, i, &r, &g, &b);
-            bmp_setpixel_4 (bmp4 , j, i, find_color(DEF_PAL_DATA, 16, r, g, b));
+    for (y=0; y<src->height; y++) {
+        p = src->pdata + y * src->stride;
+        for (x=0; x<src->width; x++, p+=3) {
+            idx[x] = lut_find_color(&lut, p[0], p[1], p[2]);
         }
+        pack_row(idx, dst->pdata + y * dst->stride, src->width, dst->cdepth);
     }
+    lut_destroy(&lut);
+    free(idx);
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    BMP bmp24 = {}, bmp4 = {};
-    char *file = "test.bmp";
-    if (argc > 1) file = argv[1];
-    bmp_load(&bmp24, file);
-    bmp_create(&bmp4, bmp24.width, bmp24.height, 4);
-    bmp24tobmp4(&bmp4, &bmp24);
-    bmp_save(&bmp4, file);
-    bmp_destroy(&bmp4 );
+    BMP      bmp24 = {}, bmpn = {};
+    MAPFILE  mf    = {};
+    uint32_t pal[256] = {0};
+    char    *file    = "test.bmp";
+    char    *outfile = NULL;
+    char    *palfile = NULL;
+    int      palsize = 16;
+    int      cdepth  = 0;
+    int      ret     = -1;
+    int      i, n    = 0;
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            palfile = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            cdepth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outfile = argv[++i];
+        } else if (n++ == 0) {
+            file = argv[i];
+        }
+    }
+    if (!outfile) outfile = file;
+
+    if (palfile) {
+        palsize = load_pal(pal, palfile);
+        if (palsize <= 0) {
+            printf("failed to load palette: %s\n", palfile);
+            return 1;
+        }
+    } else {
+        memcpy(pal, DEF_PAL_DATA, sizeof(pal));
+    }
+    if (cdepth == 0) cdepth = palsize <= 2 ? 1 : palsize <= 4 ? 2 : palsize <= 16 ? 4 : 8;
+    if ((cdepth != 1 && cdepth != 2 && cdepth != 4 && cdepth != 8) || palsize > (1 << cdepth)) {
+        printf("%d colors do not fit %d bits per pixel !\n", palsize, cdepth);
+        return 1;
+    }
+
+    // the source is read in place from the mapping, it must be unmapped
+    // before the file is overwritten with the converted one
+    if (bmp_map(&bmp24, &mf, file) < 0 && (bmp_load(&bmp24, file) < 0 || bmp24.cdepth != 24)) {
+        printf("failed to load 24bit bmp file: %s\n", file);
+        goto end;
+    }
+    bmp_create(&bmpn, bmp24.width, bmp24.height, cdepth);
+    if (!bmpn.pdata || bmp24tobmpn(&bmpn, &bmp24, pal, palsize) < 0) {
+        printf("failed to allocate memory !\n");
+        goto end;
+    }
+    if (mf.data) {
+        mapfile_close(&mf);
+        bmp24.pdata = NULL;
+    }
+    ret = bmp_save(&bmpn, outfile, pal);
+    if (ret < 0) printf("failed to save bmp file: %s\n", outfile);
+
+end:
+    if (mf.data) {
+        mapfile_close(&mf);
+        bmp24.pdata = NULL;
+    }
     bmp_destroy(&bmp24);
-    return 0;
+    bmp_destroy(&bmpn);
+    return ret < 0 ? 1 : 0;
 }
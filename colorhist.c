@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "colorhist.h"
+
+#define HIST_MIN_SIZE  4096
+
+static inline uint32_t hist_slot(const HIST *hist, uint32_t key)
+{
+    return (key * 0x9E3779B1u >> 8) & hist->mask;
+}
+
+static HISTENTRY* hist_alloc(int size)
+{
+    HISTENTRY *table = malloc(size * sizeof(HISTENTRY));
+    int        i;
+    if (table) for (i=0; i<size; i++) table[i].key = HIST_EMPTY;
+    return table;
+}
+
+// double the table when it gets half full
+static int hist_grow(HIST *hist)
+{
+    HISTENTRY *old  = hist->table;
+    int        size = hist->mask + 1;
+    uint32_t   j;
+    int        i;
+
+    hist->table = hist_alloc(size * 2);
+    if (!hist->table) {
+        hist->table = old;
+        return -1;
+    }
+    hist->mask = size * 2 - 1;
+    for (i=0; i<size; i++) {
+        if (old[i].key == HIST_EMPTY) continue;
+        for (j=hist_slot(hist, old[i].key); hist->table[j].key != HIST_EMPTY; j=(j+1) & hist->mask);
+        hist->table[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+int hist_init(HIST *hist, int bits)
+{
+    memset(hist, 0, sizeof(HIST));
+    hist->bits  = bits < 1 ? 1 : bits < 8 ? bits : 8;
+    hist->mask  = HIST_MIN_SIZE - 1;
+    hist->table = hist_alloc(HIST_MIN_SIZE);
+    return hist->table ? 0 : -1;
+}
+
+void hist_free(HIST *hist)
+{
+    free(hist->table);
+    memset(hist, 0, sizeof(HIST));
+}
+
+// the entry of key, a new one if it is not there yet, NULL if out of memory
+static inline HISTENTRY* hist_find(HIST *hist, uint32_t key)
+{
+    HISTENTRY *e;
+    uint32_t   j;
+
+    for (j=hist_slot(hist, key); hist->table[j].key != key && hist->table[j].key != HIST_EMPTY; j=(j+1) & hist->mask);
+    e = &hist->table[j];
+    if (e->key == HIST_EMPTY) {
+        if (hist->colors * 2 >= hist->mask) {
+            if (hist_grow(hist) < 0) return NULL;
+            return hist_find(hist, key);
+        }
+        memset(e, 0, sizeof(HISTENTRY));
+        e->key = key;
+        hist->colors++;
+    }
+    return e;
+}
+
+int hist_add_image(HIST *hist, const uint8_t *data, int stride, int width, int height)
+{
+    const uint8_t *p;
+    HISTENTRY     *e    = NULL;
+    int            cut  = 8 - hist->bits;
+    uint32_t       last = HIST_EMPTY;
+    uint32_t       key;
+    int            x, y;
+
+    if (hist->sorted) return -1;
+    for (y=0; y<height; y++, data+=stride) {
+        for (p=data,x=0; x<width; x++, p+=3) {
+            key = ((p[0] >> cut) << (hist->bits * 2)) | ((p[1] >> cut) << hist->bits) | (p[2] >> cut);
+            // runs of the same cell are common, they skip the lookup
+            if (key != last) {
+                if (!(e = hist_find(hist, key))) return -1;
+                last = key;
+            }
+            e->count++;
+            e->sum[0] += p[0];
+            e->sum[1] += p[1];
+            e->sum[2] += p[2];
+            e->sq     += p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+        }
+    }
+    return 0;
+}
+
+int hist_add_sample(HIST *hist, const uint8_t *data, int stride, int width, int height, int64_t count)
+{
+    const uint8_t *p;
+    HISTENTRY     *e;
+    int            cut   = 8 - hist->bits;
+    int64_t        total = (int64_t)width * height;
+    int64_t        lo, hi, pos, i;
+    uint32_t       seed  = 0x9E3779B9;
+    uint32_t       key;
+
+    if (hist->sorted) return -1;
+    if (count <= 0 || count >= total) return hist_add_image(hist, data, stride, width, height);
+    for (i=0; i<count; i++) {
+        // one pixel of each stratum, at an offset from a fixed xorshift sequence
+        lo    = total * i / count;
+        hi    = total * (i + 1) / count;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        pos   = lo + seed % (hi - lo);
+        p     = data + (int64_t)stride * (pos / width) + pos % width * 3;
+        key   = ((p[0] >> cut) << (hist->bits * 2)) | ((p[1] >> cut) << hist->bits) | (p[2] >> cut);
+        if (!(e = hist_find(hist, key))) return -1;
+        e->count++;
+        e->sum[0] += p[0];
+        e->sum[1] += p[1];
+        e->sum[2] += p[2];
+        e->sq     += p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+    }
+    return 0;
+}
+
+int hist_merge(HIST *dst, const HIST *src)
+{
+    HISTENTRY *e;
+    int        i;
+    if (dst->sorted) return -1;
+    for (i=0; i<=src->mask; i++) {
+        if (src->table[i].key == HIST_EMPTY) continue;
+        if (!(e = hist_find(dst, src->table[i].key))) return -1;
+        e->count  += src->table[i].count;
+        e->sum[0] += src->table[i].sum[0];
+        e->sum[1] += src->table[i].sum[1];
+        e->sum[2] += src->table[i].sum[2];
+        e->sq     += src->table[i].sq;
+    }
+    return 0;
+}
+
+typedef struct {
+    HIST          *hist;
+    const uint8_t *data;
+    int            stride;
+    int            width;
+    int            height;
+    int            ret;
+} HIST_JOB;
+
+static void* hist_proc(void *arg)
+{
+    HIST_JOB *job = arg;
+    job->ret = hist_add_image(job->hist, job->data, job->stride, job->width, job->height);
+    return NULL;
+}
+
+int hist_add_image_threads(HIST *hist, const uint8_t *data, int stride, int width, int height, int nthread)
+{
+    HIST_JOB  jobs [HIST_MAX_THREADS];
+    HIST      hists[HIST_MAX_THREADS];
+    pthread_t threads[HIST_MAX_THREADS];
+    int       ret = 0, y0, y1, i, n;
+
+    if (hist->sorted) return -1;
+    nthread = nthread < HIST_MAX_THREADS ? nthread : HIST_MAX_THREADS;
+    nthread = nthread < height ? nthread : height;
+    if (nthread <= 1) return hist_add_image(hist, data, stride, width, height);
+
+    // band i of the rows goes to a histogram of its own, band 0 to hist on this thread
+    for (n=1; n<nthread; n++) {
+        y0 = (int64_t)height * n / nthread;
+        y1 = (int64_t)height * (n + 1) / nthread;
+        jobs[n].hist   = &hists[n];
+        jobs[n].data   = data + (int64_t)stride * y0;
+        jobs[n].stride = stride;
+        jobs[n].width  = width;
+        jobs[n].height = y1 - y0;
+        if (hist_init(&hists[n], hist->bits) < 0) break;
+        if (pthread_create(&threads[n], NULL, hist_proc, &jobs[n]) != 0) {
+            hist_free(&hists[n]);
+            break;
+        }
+    }
+    // bands that got no thread are done here too
+    ret = hist_add_image(hist, data, stride, width, (int64_t)height * 1 / nthread);
+    if (ret == 0 && n < nthread) {
+        y0  = (int64_t)height * n / nthread;
+        ret = hist_add_image(hist, data + (int64_t)stride * y0, stride, width, height - y0);
+    }
+
+    // the sums are exact, so the merge order does not matter
+    for (i=1; i<n; i++) {
+        pthread_join(threads[i], NULL);
+        if (ret == 0) ret = jobs[i].ret;
+        if (ret == 0) ret = hist_merge(hist, &hists[i]);
+        hist_free(&hists[i]);
+    }
+    return ret;
+}
+
+static int compare_entry(const void *arg1, const void *arg2)
+{
+    uint32_t key1 = ((const HISTENTRY*)arg1)->key;
+    uint32_t key2 = ((const HISTENTRY*)arg2)->key;
+    return key1 < key2 ? -1 : key1 > key2;
+}
+
+int hist_sort(HIST *hist)
+{
+    int i, n;
+    for (i=0,n=0; i<=hist->mask; i++) {
+        if (hist->table[i].key != HIST_EMPTY) hist->table[n++] = hist->table[i];
+    }
+    for (i=n; i<=hist->mask; i++) hist->table[i].key = HIST_EMPTY;
+    qsort(hist->table, n, sizeof(HISTENTRY), compare_entry);
+    hist->sorted = 1;
+    return n;
+}
@@ -0,0 +1,48 @@
+#ifndef __COLORHIST_H__
+#define __COLORHIST_H__
+
+#include <stdint.h>
+
+// color histogram in one linear pass, one entry per distinct color, or per
+// cell when the channels are cut to fewer bits, in an open addressing hash
+// table. an entry keeps the channel sums of its pixels, so a cell still
+// averages to the exact mean of the colors that fell in it.
+#define HIST_EMPTY        0xFFFFFFFF
+#define HIST_MAX_THREADS  64
+
+typedef struct {
+    uint32_t key;    // r, g and b cut to bits each, HIST_EMPTY if unused
+    uint64_t count;  // pixels, a single color may pass 4G of them
+    uint64_t sum[3]; // r, g and b sums
+    uint64_t sq;     // sum of r * r + g * g + b * b, the spread of the cell
+} HISTENTRY;
+
+typedef struct {
+    HISTENTRY *table;
+    int        bits;   // precision per channel, 1 to 8
+    int        mask;   // table size - 1, a power of 2
+    int        colors; // entries in use
+    int        sorted; // packed by hist_sort, read only from then on
+} HIST;
+
+int  hist_init     (HIST *hist, int bits); // -1 if out of memory
+void hist_free     (HIST *hist);
+int  hist_add_image(HIST *hist, const uint8_t *data, int stride, int width, int height);
+int  hist_merge    (HIST *dst, const HIST *src); // adds the entries of src to dst
+
+// counts count pixels instead of all of them, the pixels in scan order are cut in
+// count equal strata and one pixel is taken from each at a pseudo-random offset,
+// the same ones on every run, so the cost is bounded whatever the image size.
+int  hist_add_sample(HIST *hist, const uint8_t *data, int stride, int width, int height, int64_t count);
+
+// splits the rows in nthread bands, each counted by its own thread into its own
+// histogram, the partial histograms are merged into hist at the end.
+int  hist_add_image_threads(HIST *hist, const uint8_t *data, int stride, int width, int height, int nthread);
+
+// packs the entries at the start of the table sorted by key, so the order does
+// not depend on how the histogram was filled, and empties the rest. the entries
+// are off their hash slots then, so adding or merging into it returns -1.
+// returns the number of entries.
+int  hist_sort     (HIST *hist);
+
+#endif
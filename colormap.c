@@ -0,0 +1,509 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "colormap.h"
+
+//++ colormap
+int colormap_init(COLORMAP *map, const uint8_t *pal, int size, int simd, int lutbits, int exact)
+{
+    memset(map, 0, sizeof(COLORMAP));
+    map->size = size;
+    map->pal  = malloc(size * 3);
+    map->near = malloc(sizeof(NEAREST));
+    if (!map->pal || !map->near) goto failed;
+    memcpy(map->pal, pal, size * 3);
+    nearest_init(map->near, map->pal, size, simd);
+
+    if (lutbits > 0) {
+        map->lut = calloc(1, sizeof(LUT));
+        if (!map->lut || lut_create(map->lut, map->near, lutbits, exact) < 0) goto failed;
+    } else if (size >= KDTREE_MIN_COLORS) {
+        map->kdtree = kdtree_create(map->pal, size);
+        if (!map->kdtree) goto failed;
+    }
+    return 0;
+
+failed:
+    colormap_free(map);
+    return -1;
+}
+
+int colormap_init_cpal(COLORMAP *map, const CPAL *cp, int simd)
+{
+    memset(map, 0, sizeof(COLORMAP));
+    map->size = cp->hdr->size;
+    map->pal  = malloc(map->size * 3);
+    map->near = malloc(sizeof(NEAREST));
+    if (!map->pal || !map->near) goto failed;
+    memcpy(map->pal, cp->hdr->pal, map->size * 3);
+    nearest_init_soa(map->near, cp->soa, map->size, simd);
+
+    if (cp->lut) {
+        map->lut = calloc(1, sizeof(LUT));
+        if (!map->lut) goto failed;
+        map->lut->bits  = cp->hdr->lutbits;
+        map->lut->nref  = cp->hdr->nref;
+        map->lut->near  = map->near;
+        map->lut->table = (uint16_t*)cp->lut;
+        map->lutref     = 1;
+    } else if (map->size >= KDTREE_MIN_COLORS) {
+        map->kdtree = kdtree_create(map->pal, map->size);
+        if (!map->kdtree) goto failed;
+    }
+    return 0;
+
+failed:
+    colormap_free(map);
+    return -1;
+}
+
+void colormap_free(COLORMAP *map)
+{
+    if (map->lut && !map->lutref) lut_destroy(map->lut);
+    kdtree_destroy(map->kdtree);
+    free(map->lut );
+    free(map->near);
+    free(map->pal );
+    memset(map, 0, sizeof(COLORMAP));
+}
+
+// write color i to dst, as r, g, b or as the index, returns the next pixel
+static inline uint8_t* colormap_put(COLORMAP *map, uint8_t *dst, int i)
+{
+    if (map->indexed) {
+        dst[0] = i;
+        return dst + 1;
+    }
+    dst[0] = map->pal[i * 3 + 0];
+    dst[1] = map->pal[i * 3 + 1];
+    dst[2] = map->pal[i * 3 + 2];
+    return dst + 3;
+}
+
+static int colormap_find_color_stats(COLORMAP *map, int r, int g, int b)
+{
+    int c, visits = 1;
+
+    map->lookups++;
+    if (map->lut) {
+        c = lut_cell(map->lut, r, g, b);
+        if (c & LUT_REFINE) {
+            c = nearest_find(map->near, r, g, b);
+            map->refines++;
+            visits += map->near->size;
+        }
+    } else if (map->kdtree) {
+        c = kdtree_find(map->kdtree, r, g, b, &visits);
+    } else {
+        c = nearest_find(map->near, r, g, b);
+        visits = map->near->size;
+    }
+    map->visits += visits;
+    return c;
+}
+
+static int colormap_find_color(COLORMAP *map, int r, int g, int b)
+{
+    if (map->stats ) return colormap_find_color_stats(map, r, g, b);
+    if (map->lut   ) return lut_find_color(map->lut, r, g, b);
+    if (map->kdtree) return kdtree_find(map->kdtree, r, g, b, NULL);
+    return nearest_find(map->near, r, g, b);
+}
+
+void colormap_fork(COLORMAP *dst, const COLORMAP *src)
+{
+    *dst = *src;
+    dst->lookups = dst->visits = dst->refines = 0;
+}
+
+void colormap_join(COLORMAP *dst, const COLORMAP *src)
+{
+    if (!src->stats) return;
+    __atomic_add_fetch(&dst->lookups, src->lookups, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dst->visits , src->visits , __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dst->refines, src->refines, __ATOMIC_RELAXED);
+}
+//-- colormap
+
+//++ ordered dither
+// each pixel is offset by a tiled bayer threshold scaled to the spacing of
+// the palette and then looked up, pixels do not depend on each other.
+void ordered_init(ORDERED *od, int size, const uint8_t *pal, int palsize)
+{
+    int n, x, y, v, i, j, k, d, dmin, bit;
+
+    for (n=1; n<4 && (2 << n) <= size; n++);
+    od->size = 1 << n;
+
+    // the spacing is the mean distance (per channel max) to the nearest other color
+    od->spread = 0;
+    for (i=0; i<palsize && palsize>1; i++) {
+        for (dmin=255,j=0; j<palsize; j++) {
+            if (j == i) continue;
+            for (d=0,k=0; k<3; k++) {
+                v = abs(pal[i*3+k] - pal[j*3+k]);
+                d = d > v ? d : v;
+            }
+            dmin = dmin < d ? dmin : d;
+        }
+        od->spread += dmin;
+    }
+    od->spread = palsize > 1 ? od->spread / palsize : 0;
+
+    for (y=0; y<od->size; y++) {
+        for (x=0; x<od->size; x++) {
+            for (v=0,bit=0; bit<n; bit++) {
+                v = (v << 2) | ((((x ^ y) >> bit) & 1) << 1) | ((y >> bit) & 1);
+            }
+            od->thresh[y * od->size + x] = (2 * v + 1) * od->spread / (2 * od->size * od->size) - od->spread / 2;
+        }
+    }
+}
+
+void ordered_row(COLORMAP *map, const ORDERED *od, const uint8_t *src, uint8_t *dst, int width, int y)
+{
+    const int *trow = od->thresh + (y & (od->size - 1)) * od->size;
+    int  mask = od->size - 1;
+    int  r, g, b, t, i, x;
+
+    for (x=0; x<width; x++, src+=3) {
+        t = trow[x & mask];
+        r = src[0] + t;
+        g = src[1] + t;
+        b = src[2] + t;
+        r = r < 0 ? 0 : r < 255 ? r : 255;
+        g = g < 0 ? 0 : g < 255 ? g : 255;
+        b = b < 0 ? 0 : b < 255 ? b : 255;
+        i   = colormap_find_color(map, r, g, b);
+        dst = colormap_put(map, dst, i);
+    }
+}
+
+typedef struct {
+    COLORMAP      *map;
+    const ORDERED *od;
+    BMP           *src;
+    BMP      *dst;
+    int       nextrow;
+} ORDERED_JOB;
+
+static void* ordered_proc(void *arg)
+{
+    ORDERED_JOB *job = arg;
+    BMP         *src = job->src;
+    BMP         *dst = job->dst;
+    COLORMAP     map;
+    int          y;
+    colormap_fork(&map, job->map);
+    while ((y = __atomic_fetch_add(&job->nextrow, 1, __ATOMIC_RELAXED)) < src->height) {
+        ordered_row(&map, job->od, (uint8_t*)src->pdata + y * src->stride, (uint8_t*)dst->pdata + y * dst->stride, src->width, y);
+    }
+    colormap_join(job->map, &map);
+    return NULL;
+}
+
+static void ordered_bmp(COLORMAP *map, const ORDERED *od, BMP *src, BMP *dst, int nthread)
+{
+    ORDERED_JOB job = { map, od, src, dst, 0 };
+    pthread_t   threads[256];
+    int         i;
+
+    nthread = nthread < 256 ? nthread : 256;
+    for (i=1; i<nthread; i++) {
+        if (pthread_create(&threads[i], NULL, ordered_proc, &job) != 0) break;
+    }
+    nthread = i;
+    ordered_proc(&job);
+    for (i=1; i<nthread; i++) pthread_join(threads[i], NULL);
+}
+//-- ordered dither
+
+//++ error diffusion
+// the diffused error is kept in rolling rows of signed shorts, 3 per pixel, the
+// current row and the two below, with DIFFUSE_GUARD guard pixels on both ends,
+// so the image is read and written once and only the value looked up is clamped.
+// the error for the two pixels right of the current one stays in registers,
+// carry holds it between spans, so a row can be done in several spans.
+
+// the kernels: name, divisor, weights of (x+1, y) and (x+2, y), of (x-2, y+1)
+// to (x+2, y+1) and of (x-2, y+2) to (x+2, y+2), then the pixels a row must
+// stay ahead of the row below in the wavefront, so that the second reads only
+// finished error and the two never add to the same error row cell.
+#define DIFFUSE_KERNELS(K) \
+    K(fs      , 16, 7, 0, 0, 3, 5, 1, 0, 0, 0, 0, 0, 0, 1) \
+    K(jarvis  , 48, 7, 5, 3, 5, 7, 5, 3, 1, 3, 5, 3, 1, 4) \
+    K(stucki  , 42, 8, 4, 2, 4, 8, 4, 2, 1, 2, 4, 2, 1, 4) \
+    K(sierra  , 32, 5, 3, 2, 4, 5, 4, 2, 0, 2, 3, 2, 0, 4) \
+    K(burkes  , 32, 8, 4, 2, 4, 8, 4, 2, 0, 0, 0, 0, 0, 2) \
+    K(atkinson,  8, 1, 1, 0, 1, 1, 1, 0, 0, 0, 1, 0, 0, 2)
+
+#define ALWAYS_INLINE  static inline __attribute__((always_inline))
+
+// v / div rounded toward zero the same way, without a divide instruction: a shift
+// for a power of two, otherwise a multiply by the 20 bit fixed point reciprocal,
+// which is exact for |v| < 16384, the error times a weight stays below 2048.
+ALWAYS_INLINE int diffuse_div(int v, int div)
+{
+    int s = v >> 31;
+    int m = ((1 << 20) + div - 1) / div;
+    if ((div & (div - 1)) == 0) return (v + (s & (div - 1))) >> __builtin_ctz(div);
+    return ((((v ^ s) - s) * m >> 20) ^ s) - s;
+}
+
+// error e of one channel to the rows below, the weights and the divisor are
+// constants once inlined, so zero weights go away and no division is left.
+ALWAYS_INLINE void diffuse_spread(short *e1, short *e2, int e, int div,
+    int b0, int b1, int b2, int b3, int b4, int c0, int c1, int c2, int c3, int c4)
+{
+    if (b0) e1[-6] += diffuse_div(e * b0, div);
+    if (b1) e1[-3] += diffuse_div(e * b1, div);
+    if (b2) e1[ 0] += diffuse_div(e * b2, div);
+    if (b3) e1[ 3] += diffuse_div(e * b3, div);
+    if (b4) e1[ 6] += diffuse_div(e * b4, div);
+    if (c0) e2[-6] += diffuse_div(e * c0, div);
+    if (c1) e2[-3] += diffuse_div(e * c1, div);
+    if (c2) e2[ 0] += diffuse_div(e * c2, div);
+    if (c3) e2[ 3] += diffuse_div(e * c3, div);
+    if (c4) e2[ 6] += diffuse_div(e * c4, div);
+}
+
+// src and dst may be the same row
+ALWAYS_INLINE void diffuse_kernel(COLORMAP *map, const uint8_t *src, uint8_t *dst, int width, short *erow[DIFFUSE_ROWS], int carry[DIFFUSE_CARRY],
+    int div, int a1, int a2, int b0, int b1, int b2, int b3, int b4, int c0, int c1, int c2, int c3, int c4)
+{
+    short *e0 = erow[0], *e1 = erow[1], *e2 = erow[2];
+    int    er1 = carry[0], eg1 = carry[1], eb1 = carry[2]; // error for pixel (x+1, y)
+    int    er2 = carry[3], eg2 = carry[4], eb2 = carry[5]; // error for pixel (x+2, y)
+    int    r, g, b, i, x;
+    uint8_t *c;
+
+    for (x=0; x<width; x++, src+=3, e0+=3, e1+=3, e2+=3) {
+        r = src[0] + e0[0] + er1;
+        g = src[1] + e0[1] + eg1;
+        b = src[2] + e0[2] + eb1;
+        r = r < 0 ? 0 : r < 255 ? r : 255;
+        g = g < 0 ? 0 : g < 255 ? g : 255;
+        b = b < 0 ? 0 : b < 255 ? b : 255;
+
+        i   = colormap_find_color(map, r, g, b);
+        c   = map->pal + i * 3;
+        dst = colormap_put(map, dst, i);
+
+        // calculate the error
+        r -= c[0];
+        g -= c[1];
+        b -= c[2];
+
+        // for pixels (x+1, y) and (x+2, y)
+        er1 = er2 + diffuse_div(r * a1, div); er2 = a2 ? diffuse_div(r * a2, div) : 0;
+        eg1 = eg2 + diffuse_div(g * a1, div); eg2 = a2 ? diffuse_div(g * a2, div) : 0;
+        eb1 = eb2 + diffuse_div(b * a1, div); eb2 = a2 ? diffuse_div(b * a2, div) : 0;
+
+        // for the rows below
+        diffuse_spread(e1 + 0, e2 + 0, r, div, b0, b1, b2, b3, b4, c0, c1, c2, c3, c4);
+        diffuse_spread(e1 + 1, e2 + 1, g, div, b0, b1, b2, b3, b4, c0, c1, c2, c3, c4);
+        diffuse_spread(e1 + 2, e2 + 2, b, div, b0, b1, b2, b3, b4, c0, c1, c2, c3, c4);
+    }
+    carry[0] = er1; carry[1] = eg1; carry[2] = eb1;
+    carry[3] = er2; carry[4] = eg2; carry[5] = eb2;
+}
+
+typedef void (*DIFFUSE_ROW)(COLORMAP *map, const uint8_t *src, uint8_t *dst, int width, short *erow[DIFFUSE_ROWS], int carry[DIFFUSE_CARRY]);
+
+typedef struct {
+    char        *name;
+    DIFFUSE_ROW  row;
+    int          lead;
+} KERNEL;
+
+// one specialized row function per kernel
+#define DIFFUSE_DEFINE(name, div, a1, a2, b0, b1, b2, b3, b4, c0, c1, c2, c3, c4, lead) \
+static void diffuse_row_##name(COLORMAP *map, const uint8_t *src, uint8_t *dst, int width, short *erow[DIFFUSE_ROWS], int carry[DIFFUSE_CARRY]) \
+{ \
+    diffuse_kernel(map, src, dst, width, erow, carry, div, a1, a2, b0, b1, b2, b3, b4, c0, c1, c2, c3, c4); \
+}
+DIFFUSE_KERNELS(DIFFUSE_DEFINE)
+
+#define DIFFUSE_ENTRY(name, div, a1, a2, b0, b1, b2, b3, b4, c0, c1, c2, c3, c4, lead) { #name, diffuse_row_##name, lead },
+static const KERNEL g_kernels[] = { DIFFUSE_KERNELS(DIFFUSE_ENTRY) };
+#define KERNEL_NUM  ((int)(sizeof(g_kernels) / sizeof(g_kernels[0])))
+
+int kernel_find(const char *name)
+{
+    int i;
+    for (i=0; i<KERNEL_NUM && strcmp(g_kernels[i].name, name) != 0; i++);
+    return i < KERNEL_NUM ? i : -1;
+}
+
+const char* kernel_name(int kernel)
+{
+    return kernel >= 0 && kernel < KERNEL_NUM ? g_kernels[kernel].name : NULL;
+}
+
+void diffuse_row(COLORMAP *map, const uint8_t *src, uint8_t *dst, int width, short *erow[DIFFUSE_ROWS], int carry[DIFFUSE_CARRY])
+{
+    g_kernels[map->kernel].row(map, src, dst, width, erow, carry);
+}
+
+int errrows_init(ERRROWS *er, int width)
+{
+    int i;
+    er->n   = (width + DIFFUSE_GUARD * 2) * 3;
+    er->buf = calloc(er->n * DIFFUSE_ROWS, sizeof(short));
+    for (i=0; i<DIFFUSE_ROWS; i++) er->row[i] = er->buf + er->n * i + DIFFUSE_GUARD * 3;
+    return er->buf ? 0 : -1;
+}
+
+// move down a row, the row left is cleared and becomes the last one
+void errrows_next(ERRROWS *er)
+{
+    short *first = er->row[0];
+    int    i;
+    for (i=0; i<DIFFUSE_ROWS-1; i++) er->row[i] = er->row[i + 1];
+    er->row[DIFFUSE_ROWS - 1] = first;
+    memset(first - DIFFUSE_GUARD * 3, 0, er->n * sizeof(short));
+}
+
+// src and dst may be the same bmp
+static int dither_bmp(COLORMAP *map, BMP *src, BMP *dst)
+{
+    ERRROWS  er;
+    uint8_t *sline = src->pdata;
+    uint8_t *dline = dst->pdata;
+    int      y;
+
+    if (errrows_init(&er, src->width) < 0) return -1;
+    for (y=0; y<src->height; y++, sline+=src->stride, dline+=dst->stride) {
+        int carry[DIFFUSE_CARRY] = {0};
+        diffuse_row(map, sline, dline, src->width, er.row, carry);
+        errrows_next(&er);
+    }
+    free(er.buf);
+    return 0;
+}
+
+void quantize_row(COLORMAP *map, const uint8_t *src, uint8_t *dst, int width)
+{
+    int i, x;
+    for (x=0; x<width; x++, src+=3) {
+        i   = colormap_find_color(map, src[0], src[1], src[2]);
+        dst = colormap_put(map, dst, i);
+    }
+}
+
+static void quantize_bmp(COLORMAP *map, BMP *src, BMP *dst)
+{
+    uint8_t *sline = src->pdata;
+    uint8_t *dline = dst->pdata;
+    int      y;
+    for (y=0; y<src->height; y++, sline+=src->stride, dline+=dst->stride) {
+        quantize_row(map, sline, dline, src->width);
+    }
+}
+
+//-- error diffusion
+
+//++ wavefront
+// the threads take rows in order, row y may dither pixel x once row y-1 has
+// finished pixel x+lead of the kernel, which is published through progress[y-1].
+// the error rows live in a ring of nthread+DIFFUSE_ROWS slots, a slot is cleared
+// by the row two above it, rows finish in order so the row that used it last is done.
+#define WAVEFRONT_SPAN  64
+
+typedef struct {
+    COLORMAP *map;
+    BMP      *src;
+    BMP      *dst;
+    short    *ebuf;     // ring of error rows
+    int       nring;
+    int       nerr;     // shorts per error row
+    int      *progress; // finished pixels of each row
+    int       nextrow;  // next row to take
+} WAVEFRONT;
+
+static void* wavefront_proc(void *arg)
+{
+    WAVEFRONT *wf = arg;
+    BMP       *pb = wf->src;
+    BMP       *pd = wf->dst;
+    COLORMAP   map;
+    short     *erow[DIFFUSE_ROWS], *espan[DIFFUSE_ROWS];
+    int        carry[DIFFUSE_CARRY];
+    int        lead = g_kernels[wf->map->kernel].lead;
+    int        x, y, i, next, need;
+
+    colormap_fork(&map, wf->map);
+    while ((y = __atomic_fetch_add(&wf->nextrow, 1, __ATOMIC_RELAXED)) < pb->height) {
+        for (i=0; i<DIFFUSE_ROWS; i++) erow[i] = wf->ebuf + (y + i) % wf->nring * wf->nerr + DIFFUSE_GUARD * 3;
+        memset(erow[DIFFUSE_ROWS - 1] - DIFFUSE_GUARD * 3, 0, wf->nerr * sizeof(short));
+        memset(carry, 0, sizeof(carry));
+
+        for (x=0; x<pb->width; x=next) {
+            next = x + WAVEFRONT_SPAN < pb->width ? x + WAVEFRONT_SPAN : pb->width;
+            if (y > 0) {
+                need = next + lead < pb->width ? next + lead : pb->width;
+                while (__atomic_load_n(&wf->progress[y - 1], __ATOMIC_ACQUIRE) < need) sched_yield();
+            }
+            for (i=0; i<DIFFUSE_ROWS; i++) espan[i] = erow[i] + x * 3;
+            diffuse_row(&map, (uint8_t*)pb->pdata + y * pb->stride + x * 3, (uint8_t*)pd->pdata + y * pd->stride + x * (map.indexed ? 1 : 3),
+                next - x, espan, carry);
+            __atomic_store_n(&wf->progress[y], next, __ATOMIC_RELEASE);
+        }
+    }
+    colormap_join(wf->map, &map);
+    return NULL;
+}
+
+// same result as dither_bmp bit for bit, the calling thread is one of the workers
+static int dither_bmp_mt(COLORMAP *map, BMP *pb, BMP *pd, int nthread)
+{
+    WAVEFRONT  wf      = {0};
+    pthread_t *threads = NULL;
+    int        i;
+
+    wf.map      = map;
+    wf.src      = pb;
+    wf.dst      = pd;
+    wf.nring    = nthread + DIFFUSE_ROWS;
+    wf.nerr     = (pb->width + DIFFUSE_GUARD * 2) * 3;
+    wf.ebuf     = calloc(wf.nring * wf.nerr, sizeof(short));
+    wf.progress = calloc(pb->height, sizeof(int));
+    threads     = calloc(nthread, sizeof(pthread_t));
+    if (!wf.ebuf || !wf.progress || !threads) {
+        free(threads);
+        free(wf.progress);
+        free(wf.ebuf);
+        return -1;
+    }
+
+    // if a thread fails to start the others just take more rows
+    for (i=1; i<nthread; i++) {
+        if (pthread_create(&threads[i], NULL, wavefront_proc, &wf) != 0) break;
+    }
+    nthread = i;
+    wavefront_proc(&wf);
+    for (i=1; i<nthread; i++) pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(wf.progress);
+    free(wf.ebuf);
+    return 0;
+}
+//-- wavefront
+
+//++ dispatch
+int dither_image(COLORMAP *map, const ORDERED *od, int dither, int nthread, BMP *src, BMP *dst)
+{
+    if (dither == DITHER_ORDERED) {
+        ordered_bmp(map, od, src, dst, nthread);
+    } else if (dither && nthread > 1) {
+        return dither_bmp_mt(map, src, dst, nthread);
+    } else if (dither) {
+        return dither_bmp(map, src, dst);
+    } else {
+        quantize_bmp(map, src, dst);
+    }
+    return 0;
+}
+//-- dispatch
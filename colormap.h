@@ -0,0 +1,92 @@
+#ifndef __COLORMAP_H__
+#define __COLORMAP_H__
+
+#include <stdint.h>
+#include "nearest.h"
+#include "cpal.h"
+
+// image in memory, 3 bytes per pixel, or 1 for palette indices,
+// rows are stride bytes apart, the stride is negative for bottom-up rows.
+typedef struct {
+    int   width;
+    int   height;
+    int   stride;
+    void *pdata;
+} BMP;
+
+//++ colormap
+#define DITHER_NONE     0
+#define DITHER_DIFFUSE  1
+#define DITHER_ORDERED  2
+
+// palette plus the structure used to look colors up in it
+typedef struct {
+    uint8_t *pal;
+    int      size;
+    KDTREE  *kdtree; // used if no lut, NULL means linear search
+    LUT     *lut;
+    NEAREST *near;
+    int      stats;   // count the lookups below, threads work on a copy and add up at the end
+    int64_t  lookups;
+    int64_t  visits;  // kdtree nodes, palette entries or lut cells visited
+    int64_t  refines; // lut cells that needed the exact search
+    int      indexed; // output palette indices, one byte per pixel, instead of r, g, b
+    int      kernel;  // error diffusion kernel, see kernel_find
+    int      lutref;  // the lut table lives in a compiled palette and is not freed
+} COLORMAP;
+
+// builds the lookup for pal, the lut if lutbits > 0, else the kdtree for large
+// palettes, else the simd search limited to level simd. the palette is copied,
+// everything is owned by the map and freed by colormap_free.
+int  colormap_init(COLORMAP *map, const uint8_t *pal, int size, int simd, int lutbits, int exact);
+// same from a compiled palette, the soa layout is copied and its lut table is
+// used in place, so cp must stay open until colormap_free.
+int  colormap_init_cpal(COLORMAP *map, const CPAL *cp, int simd);
+void colormap_free(COLORMAP *map);
+
+// per thread copy of the colormap for the counters
+void colormap_fork(COLORMAP *dst, const COLORMAP *src);
+void colormap_join(COLORMAP *dst, const COLORMAP *src);
+//-- colormap
+
+//++ ordered dither
+#define ORDERED_MAX_SIZE  16
+
+typedef struct {
+    int size;   // matrix size, power of 2
+    int spread; // threshold amplitude
+    int thresh[ORDERED_MAX_SIZE * ORDERED_MAX_SIZE];
+} ORDERED;
+
+void ordered_init(ORDERED *od, int size, const uint8_t *pal, int palsize);
+void ordered_row (COLORMAP *map, const ORDERED *od, const uint8_t *src, uint8_t *dst, int width, int y);
+//-- ordered dither
+
+//++ error diffusion
+#define DIFFUSE_GUARD  2 // guard pixels on both ends of an error row
+#define DIFFUSE_ROWS   3 // error rows, the current one and the two below
+#define DIFFUSE_CARRY  6 // error for the two pixels right of a span
+
+// rolling error rows of the serial paths, row[0] is the current one
+typedef struct {
+    short *buf;
+    short *row[DIFFUSE_ROWS];
+    int    n; // shorts per row, guards included
+} ERRROWS;
+
+int  errrows_init(ERRROWS *er, int width);
+void errrows_next(ERRROWS *er);
+
+int         kernel_find(const char *name); // -1 if unknown
+const char* kernel_name(int kernel);
+
+// src and dst may be the same row, carry is zero at the start of a row
+void diffuse_row (COLORMAP *map, const uint8_t *src, uint8_t *dst, int width, short *erow[DIFFUSE_ROWS], int carry[DIFFUSE_CARRY]);
+void quantize_row(COLORMAP *map, const uint8_t *src, uint8_t *dst, int width);
+//-- error diffusion
+
+// run the dither mode from src to dst, dst may be src or an indexed image of the same size,
+// nthread > 1 splits ordered dither by rows and error diffusion along a wavefront.
+int dither_image(COLORMAP *map, const ORDERED *od, int dither, int nthread, BMP *src, BMP *dst);
+
+#endif
@@ -0,0 +1,117 @@
+#include <string.h>
+#include "cpal.h"
+#include "nearest.h"
+
+#define CPAL_ALIGNED(x)  (((x) + CPAL_ALIGN - 1) & ~(CPAL_ALIGN - 1))
+
+uint64_t cpal_hash(const uint8_t *pal, int size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int      i;
+    for (i=0; i<size * 3; i++) {
+        h ^= pal[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int cpal_save(const char *file, const uint8_t *pal, int size, int lutbits, int exact)
+{
+    CPALHDR  hdr  = {0};
+    NEAREST  near;
+    LUT      lut  = {0};
+    MAPFILE  mf;
+    int64_t  total;
+    int      count, ret = -1;
+
+    if (size < 1 || size > 256 || lutbits < 0 || lutbits > LUT_MAX_BITS) return -1;
+    nearest_init(&near, pal, size, NEAREST_AUTO);
+    if (lutbits > 0 && lut_create(&lut, &near, lutbits, exact) < 0) return -1;
+
+    count       = NEAREST_SOA_COUNT(size);
+    hdr.magic   = CPAL_MAGIC;
+    hdr.version = CPAL_VERSION;
+    hdr.size    = size;
+    hdr.lutbits = lutbits;
+    hdr.exact   = lutbits > 0 && exact;
+    hdr.nref    = lut.nref;
+    hdr.soaoff  = CPAL_ALIGNED(sizeof(CPALHDR));
+    hdr.lutoff  = lutbits > 0 ? CPAL_ALIGNED(hdr.soaoff + count * 3 * sizeof(int16_t)) : 0;
+    hdr.hash    = cpal_hash(pal, size);
+    memcpy(hdr.pal, pal, size * 3);
+    total = lutbits > 0 ? hdr.lutoff + ((int64_t)sizeof(uint16_t) << (lutbits * 3)) : hdr.soaoff + count * 3 * sizeof(int16_t);
+
+    // written straight to the page cache, the gaps stay zero
+    if (mapfile_create(&mf, file, total) < 0) goto done;
+    memcpy(mf.data, &hdr, sizeof(hdr));
+    memcpy(mf.data + hdr.soaoff + count * sizeof(int16_t) * 0, near.r, count * sizeof(int16_t));
+    memcpy(mf.data + hdr.soaoff + count * sizeof(int16_t) * 1, near.g, count * sizeof(int16_t));
+    memcpy(mf.data + hdr.soaoff + count * sizeof(int16_t) * 2, near.b, count * sizeof(int16_t));
+    if (lutbits > 0) memcpy(mf.data + hdr.lutoff, lut.table, sizeof(uint16_t) << (lutbits * 3));
+    mapfile_close(&mf);
+    ret = 0;
+
+done:
+    if (lutbits > 0) lut_destroy(&lut);
+    return ret;
+}
+
+// the hash only covers the palette, so the tables are checked against it: the soa
+// layout must be the one of the palette and every lut cell a valid index, a bad
+// cell would index past the palette when dithering.
+static int cpal_check(const CPALHDR *hdr, const int16_t *soa, const uint16_t *lut)
+{
+    NEAREST  near;
+    int64_t  ncell, nref, i;
+    uint16_t c;
+
+    nearest_init(&near, hdr->pal, hdr->size, NEAREST_SCALAR);
+    if (memcmp(soa + near.count * 0, near.r, near.count * sizeof(int16_t))
+     || memcmp(soa + near.count * 1, near.g, near.count * sizeof(int16_t))
+     || memcmp(soa + near.count * 2, near.b, near.count * sizeof(int16_t))) return -1;
+    if (!lut) return 0;
+
+    ncell = (int64_t)1 << (hdr->lutbits * 3);
+    for (i=0,nref=0; i<ncell; i++) {
+        c     = lut[i];
+        nref += (c & LUT_REFINE) != 0;
+        if ((c & ~LUT_REFINE) >= hdr->size) return -1;
+    }
+    return nref == hdr->nref && (hdr->exact || nref == 0) ? 0 : -1;
+}
+
+int cpal_open(CPAL *cp, const char *file)
+{
+    const CPALHDR *hdr;
+    int64_t        end;
+    int            ret = -1;
+
+    memset(cp, 0, sizeof(CPAL));
+    if (mapfile_open(&cp->mf, file) < 0) return -1;
+    hdr = (const CPALHDR*)cp->mf.data;
+    if (cp->mf.size < (int64_t)sizeof(CPALHDR) || hdr->magic != CPAL_MAGIC || hdr->version != CPAL_VERSION) goto failed;
+    ret = -2;
+    if (hdr->size < 1 || hdr->size > 256 || hdr->lutbits > LUT_MAX_BITS || hdr->soaoff % CPAL_ALIGN || hdr->lutoff % CPAL_ALIGN) goto failed;
+    end = hdr->soaoff + (int64_t)NEAREST_SOA_COUNT(hdr->size) * 3 * sizeof(int16_t);
+    if (hdr->soaoff < sizeof(CPALHDR) || end > cp->mf.size) goto failed;
+    if (hdr->lutbits > 0) {
+        end = hdr->lutoff + ((int64_t)sizeof(uint16_t) << (hdr->lutbits * 3));
+        if (hdr->lutoff < sizeof(CPALHDR) || end > cp->mf.size) goto failed;
+        cp->lut = (const uint16_t*)(cp->mf.data + hdr->lutoff);
+    }
+    if (hdr->hash != cpal_hash(hdr->pal, hdr->size)) goto failed;
+    cp->hdr = hdr;
+    cp->soa = (const int16_t*)(cp->mf.data + hdr->soaoff);
+    if (cpal_check(hdr, cp->soa, cp->lut) < 0) goto failed;
+    return 0;
+
+failed:
+    cpal_close(cp);
+    return ret;
+}
+
+void cpal_close(CPAL *cp)
+{
+    if (cp->mf.data) mapfile_close(&cp->mf);
+    memset(cp, 0, sizeof(CPAL));
+}
@@ -0,0 +1,45 @@
+#ifndef __CPAL_H__
+#define __CPAL_H__
+
+#include <stdint.h>
+#include "mapfile.h"
+
+// compiled palette, the palette with the soa layout of the nearest color search
+// and optionally the inverse colormap table, laid out to be mapped and used in
+// place, so loading it is an mmap and one check pass, with no table build.
+// integers are in host byte order, sections start on a cache line.
+#define CPAL_MAGIC    0x4C415043 // "CPAL"
+#define CPAL_VERSION  1
+#define CPAL_ALIGN    64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;    // palette entries, 1 to 256
+    uint32_t lutbits; // inverse colormap bits per channel, 0 if there is no table
+    uint32_t exact;   // cells not owned by a single color are marked LUT_REFINE
+    uint32_t nref;    // number of cells marked LUT_REFINE
+    uint32_t soaoff;  // int16_t r, g and b arrays of NEAREST_SOA_COUNT(size) entries
+    uint32_t lutoff;  // uint16_t table of 1 << (lutbits * 3) cells, 0 if there is none
+    uint64_t hash;    // fnv-1a of the palette entries, checked when opened
+    uint8_t  pal[256 * 3];
+} CPALHDR;
+
+typedef struct {
+    MAPFILE         mf;
+    const CPALHDR  *hdr;
+    const int16_t  *soa;
+    const uint16_t *lut; // NULL if there is no table
+} CPAL;
+
+uint64_t cpal_hash(const uint8_t *pal, int size);
+
+// builds the soa layout, and the lut if lutbits > 0, and writes them with pal to file
+int  cpal_save (const char *file, const uint8_t *pal, int size, int lutbits, int exact);
+
+// maps file read only, returns -1 if it is not a compiled palette, -2 if it is
+// one but damaged: out of bounds sections, a bad hash or tables not matching the palette
+int  cpal_open (CPAL *cp, const char *file);
+void cpal_close(CPAL *cp);
+
+#endif
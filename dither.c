@@ -1,12 +1,30 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
-
-// Ͷ
-typedef unsigned char  uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned int   uint32_t;
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "colormap.h"
+#include "mapfile.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
+#define fseek64 _fseeki64
+#define dup     _dup
+#define dup2    _dup2
+#define fileno  _fileno
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#define fseek64 fseeko
+#endif
 
 // ڲͶ
 #pragma pack(1)
@@ -30,21 +48,38 @@ typedef struct {
 } BMPFILEHEADER;
 #pragma pack()
 
-/* BMP Ͷ */
-typedef struct
-{
-    int   width;   /*  */
-    int   height;  /* ߶ */
-    int   stride;  /* ֽ */
-    void *pdata;   /* ָ */
-} BMP;
-
 /* ڲʵ */
 static int ALIGN(int x, int y) {
     // y must be a power of 2.
     return (x + y - 1) & ~(y - 1);
 }
 
+static double get_time_ms(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, tick;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&tick);
+    return (double)tick.QuadPart * 1000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+// peak resident memory of the process in KB
+static long get_peak_mem_kb(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc = { sizeof(pmc) };
+    return K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? (long)(pmc.PeakWorkingSetSize / 1024) : 0;
+#else
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+#endif
+}
+
 /* ʵ */
 static int bmp_load(BMP *pb, char *file)
 {
@@ -73,16 +108,91 @@ static int bmp_load(BMP *pb, char *file)
     return pb->pdata ? 0 : -1;
 }
 
-#if 0
-static int bmp_create(BMP *pb, int w, int h)
+static int bmp_create(BMP *pb, int w, int h, int cdepth)
 {
     pb->width  = w;
     pb->height = h;
-    pb->stride = ALIGN(w * 3, 4);
+    pb->stride = ALIGN(w * cdepth / 8, 4);
     pb->pdata  = malloc(pb->stride * h);
     return pb->pdata ? 0 : -1;
 }
-#endif
+
+// bits per pixel of the indexed output for a palette size
+static int index_depth(int palsize)
+{
+    return palsize <= 2 ? 1 : palsize <= 4 ? 2 : palsize <= 16 ? 4 : 8;
+}
+
+// file header plus the colour table for cdepth <= 8, returns the size written to buf.
+// the palette bytes go to the table in the same order they go to 24bit pixels.
+static int bmp_header(uint8_t *buf, int w, int h, int cdepth, uint8_t *pal, int palsize)
+{
+    BMPFILEHEADER header = {0};
+    int           stride = ALIGN((w * cdepth + 7) / 8, 4);
+    int           ncolor = cdepth <= 8 ? palsize : 0;
+    int           i;
+
+    header.bfType     = ('B' << 0) | ('M' << 8);
+    header.bfOffBits  = sizeof(header) + ncolor * 4;
+    header.bfSize     = header.bfOffBits + (uint32_t)stride * h;
+    header.biSize     = 40;
+    header.biWidth    = w;
+    header.biHeight   = h;
+    header.biPlanes   = 1;
+    header.biBitCount = cdepth;
+    header.biSizeImage= (uint32_t)stride * h;
+    header.biClrUsed  = ncolor;
+    memcpy(buf, &header, sizeof(header));
+    for (i=0; i<ncolor; i++) {
+        buf[sizeof(header) + i * 4 + 0] = pal[i * 3 + 0];
+        buf[sizeof(header) + i * 4 + 1] = pal[i * 3 + 1];
+        buf[sizeof(header) + i * 4 + 2] = pal[i * 3 + 2];
+        buf[sizeof(header) + i * 4 + 3] = 0;
+    }
+    return header.bfOffBits;
+}
+
+// pack a row of 8bit palette indices to cdepth bits per pixel, leftmost pixel in the high bits
+static void pack_row(const uint8_t *idx, uint8_t *dst, int width, int cdepth)
+{
+    int ppb = 8 / cdepth;
+    int x, k, v;
+    if (cdepth == 8) {
+        memcpy(dst, idx, width);
+        return;
+    }
+    for (x=0; x<width; x+=ppb) {
+        for (v=0, k=0; k<ppb; k++) v = (v << cdepth) | (x + k < width ? idx[x + k] : 0);
+        *dst++ = v;
+    }
+}
+
+// pb holds 8bit palette indices, saved with cdepth bits per pixel
+static int bmp_save_indexed(BMP *pb, char *file, int cdepth, uint8_t *pal, int palsize)
+{
+    uint8_t  header[sizeof(BMPFILEHEADER) + 256 * 4];
+    int      stride = ALIGN((pb->width * cdepth + 7) / 8, 4);
+    uint8_t *line   = calloc(1, stride);
+    uint8_t *pdata;
+    FILE    *fp     = NULL;
+    int      ret    = -1;
+    int      i;
+
+    fp = line ? fopen(file, "wb") : NULL;
+    if (fp) {
+        fwrite(header, bmp_header(header, pb->width, pb->height, cdepth, pal, palsize), 1, fp);
+        pdata = (uint8_t*)pb->pdata + pb->stride * pb->height;
+        for (i=0; i<pb->height; i++) {
+            pdata -= pb->stride;
+            pack_row(pdata, line, pb->width, cdepth);
+            fwrite(line, stride, 1, fp);
+        }
+        ret = ferror(fp) ? -1 : 0;
+        fclose(fp);
+    }
+    free(line);
+    return ret;
+}
 
 static int bmp_save(BMP *pb, char *file)
 {
@@ -115,6 +225,51 @@ static int bmp_save(BMP *pb, char *file)
     return fp ? 0 : -1;
 }
 
+// map a 24bit bmp read only, pdata points at the top row inside the mapping and
+// the stride is negative for the usual bottom-up file, no pixel is copied
+static int bmp_map(BMP *pb, MAPFILE *mf, char *file)
+{
+    BMPFILEHEADER header;
+    int64_t       size;
+
+    if (mapfile_open(mf, file) < 0) return -1;
+    if (mf->size < (int64_t)sizeof(header)) goto failed;
+    memcpy(&header, mf->data, sizeof(header));
+    if (header.biBitCount != 24 || header.biCompression != 0 || (int32_t)header.biWidth <= 0 || header.biHeight == 0) goto failed;
+    pb->width  = header.biWidth;
+    pb->height = abs((int32_t)header.biHeight);
+    pb->stride = ALIGN(pb->width * 3, 4);
+    size = (int64_t)pb->stride * pb->height;
+    if (header.bfOffBits + size > mf->size) goto failed;
+    if ((int32_t)header.biHeight < 0) { // top-down
+        pb->pdata  = mf->data + header.bfOffBits;
+    } else {
+        pb->pdata  = mf->data + header.bfOffBits + size - pb->stride;
+        pb->stride = -pb->stride;
+    }
+    return 0;
+
+failed:
+    mapfile_close(mf);
+    return -1;
+}
+
+// create a 24bit or indexed bmp of its final size and map it, the pixels are written in place
+static int bmp_map_create(BMP *pb, MAPFILE *mf, char *file, int w, int h, int cdepth, uint8_t *pal, int palsize)
+{
+    uint8_t header[sizeof(BMPFILEHEADER) + 256 * 4];
+    int     stride = ALIGN((w * cdepth + 7) / 8, 4);
+    int     offset = bmp_header(header, w, h, cdepth, pal, palsize);
+
+    if (mapfile_create(mf, file, offset + (int64_t)stride * h) < 0) return -1;
+    memcpy(mf->data, header, offset);
+    pb->width  = w;
+    pb->height = h;
+    pb->stride = -stride;
+    pb->pdata  = mf->data + offset + (int64_t)stride * (h - 1);
+    return 0;
+}
+
 static void bmp_free(BMP *pb)
 {
     if (pb->pdata) {
@@ -126,182 +281,769 @@ static void bmp_free(BMP *pb)
     pb->stride = 0;
 }
 
-static void bmp_setpixel(BMP *pb, int x, int y, int r, int g, int b)
+//++ stream
+// dither file to file a row at a time, memory use does not depend on the image height.
+// rows are stored bottom-up, so they are visited by seeking to get the same result as dither_bmp.
+static int stream_bmp(COLORMAP *map, ORDERED *od, char *src, char *dst, int dither, BMP *pb)
+{
+    BMPFILEHEADER header = {0};
+    uint8_t       hdrbuf[sizeof(BMPFILEHEADER) + 256 * 4];
+    FILE         *fpin   = NULL;
+    FILE         *fpout  = NULL;
+    uint8_t      *line   = NULL;
+    uint8_t      *oline  = NULL;
+    ERRROWS       er     = {0};
+    int64_t       offset;
+    int           cdepth = map->indexed ? index_depth(map->size) : 24;
+    int           ostride, ohead;
+    int           ret    = -1;
+    int           y;
+
+    fpin = fopen(src, "rb");
+    if (!fpin) goto done;
+    if (fread(&header, sizeof(header), 1, fpin) != 1 || header.biBitCount != 24) goto done;
+    pb->width  = header.biWidth;
+    pb->height = header.biHeight;
+    pb->stride = ALIGN(header.biWidth * 3, 4);
+    offset     = header.bfOffBits;
+    ostride    = ALIGN((pb->width * cdepth + 7) / 8, 4);
+
+    // indexed rows are dithered to a byte per pixel, then packed to oline
+    line  = malloc(pb->stride);
+    oline = map->indexed ? calloc(1, ostride + pb->width) : line;
+    if (!line || !oline || errrows_init(&er, pb->width) < 0) goto done;
+
+    fpout = fopen(dst, "wb");
+    if (!fpout) goto done;
+    ohead = bmp_header(hdrbuf, pb->width, pb->height, cdepth, map->pal, map->size);
+    fwrite(hdrbuf, ohead, 1, fpout);
+
+    for (y=0; y<pb->height; y++) {
+        uint8_t *orow = map->indexed ? oline + ostride : line;
+        fseek64(fpin, offset + (int64_t)pb->stride * (pb->height - 1 - y), SEEK_SET);
+        if (fread(line, pb->stride, 1, fpin) != 1) goto done;
+        if (dither == DITHER_ORDERED) {
+            ordered_row(map, od, line, orow, pb->width, y);
+        } else if (dither) {
+            int carry[DIFFUSE_CARRY] = {0};
+            diffuse_row(map, line, orow, pb->width, er.row, carry);
+            errrows_next(&er);
+        } else {
+            quantize_row(map, line, orow, pb->width);
+        }
+        if (map->indexed) pack_row(orow, oline, pb->width, cdepth);
+        fseek64(fpout, ohead + (int64_t)ostride * (pb->height - 1 - y), SEEK_SET);
+        if (fwrite(oline, ostride, 1, fpout) != 1) goto done;
+    }
+    ret = 0;
+
+done:
+    if (fpout) fclose(fpout);
+    if (fpin ) fclose(fpin );
+    free(er.buf);
+    if (oline != line) free(oline);
+    free(line);
+    return ret;
+}
+//-- stream
+
+
+//++ dispatch
+// loaded image, dithered in place for 24bit output or into idx for indexed output
+static int dither_loaded(COLORMAP *map, ORDERED *od, int dither, int nthread, BMP *pb, BMP *idx)
 {
-    uint8_t *pbyte = pb->pdata;
-    if (x >= pb->width || y >= pb->height) return;
-    r = r < 0 ? 0 : r < 255 ? r : 255;
-    g = g < 0 ? 0 : g < 255 ? g : 255;
-    b = b < 0 ? 0 : b < 255 ? b : 255;
-    pbyte[x * 3 + 0 + y * pb->stride] = r;
-    pbyte[x * 3 + 1 + y * pb->stride] = g;
-    pbyte[x * 3 + 2 + y * pb->stride] = b;
+    if (!map->indexed) return dither_image(map, od, dither, nthread, pb, pb);
+    if (bmp_create(idx, pb->width, pb->height, 8) < 0) return -1;
+    return dither_image(map, od, dither, nthread, pb, idx);
 }
 
-static void bmp_getpixel(BMP *pb, int x, int y, int *r, int *g, int *b)
+static int save_loaded(COLORMAP *map, BMP *pb, BMP *idx, char *file)
 {
-    uint8_t *pbyte = pb->pdata;
-    if (x >= pb->width || y >= pb->height) {
-        *r = *g = *b = 0;
-        return;
+    if (!map->indexed) return bmp_save(pb, file);
+    return bmp_save_indexed(idx, file, index_depth(map->size), map->pal, map->size);
+}
+//-- dispatch
+
+//++ mmap
+
+// dither file to file through memory mappings, the source is read in place and
+// the result goes straight into the mapped output, the image is never copied.
+// indexed output below 8 bits is dithered to a byte per pixel and packed into the mapping.
+static int mmap_bmp(COLORMAP *map, ORDERED *od, char *src, char *dst, int dither, int nthread, BMP *pb)
+{
+    MAPFILE fin  = {0}, fout = {0};
+    BMP     bin  = {0}, bout = {0}, bidx = {0};
+    int     cdepth = map->indexed ? index_depth(map->size) : 24;
+    int     ret  = -1;
+    int     y;
+
+    if (bmp_map(&bin, &fin, src) < 0) goto done;
+    if (bmp_map_create(&bout, &fout, dst, bin.width, bin.height, cdepth, map->pal, map->size) < 0) goto done;
+    if (cdepth < 8) {
+        if (bmp_create(&bidx, bin.width, bin.height, 8) < 0) goto done;
+        ret = dither_image(map, od, dither, nthread, &bin, &bidx);
+        for (y=0; y<bin.height; y++) {
+            pack_row((uint8_t*)bidx.pdata + y * bidx.stride, (uint8_t*)bout.pdata + y * bout.stride, bin.width, cdepth);
+        }
+    } else {
+        ret = dither_image(map, od, dither, nthread, &bin, &bout);
+    }
+
+done:
+    bmp_free(&bidx);
+    mapfile_close(&fout);
+    mapfile_close(&fin );
+    pb->width  = bin.width;
+    pb->height = bin.height;
+    return ret;
+}
+//-- mmap
+
+//++ batch
+// dither many files with one colormap, the files are shared out to a pool of threads,
+// each file is dithered by one thread, the colormap is only read.
+typedef struct {
+    COLORMAP *map;
+    ORDERED  *od;
+    int       dither;
+    int       stream;
+    int       mapped;
+    char    **files;
+    int       nfile;
+    int       nextfile;
+    int       nfailed;
+    int64_t   npixel;
+} BATCH;
+
+// dither-xxx.bmp next to the source file, -1 if it does not fit in size bytes
+static int make_outfile(char *outfile, int size, char *bmpfile)
+{
+    char *name = bmpfile;
+    char *p;
+    int   n;
+    for (p=bmpfile; *p; p++) {
+        if (*p == '/' || *p == '\\') name = p + 1;
+    }
+    n = snprintf(outfile, size, "%.*sdither-%s", (int)(name - bmpfile), bmpfile, name);
+    return n >= 0 && n < size ? 0 : -1;
+}
+
+static int compare_file(const void *arg1, const void *arg2)
+{
+    return strcmp(*(char**)arg1, *(char**)arg2);
+}
+
+static int batch_add_file(BATCH *batch, char *file)
+{
+    char **files;
+    if ((batch->nfile & 255) == 0) {
+        files = realloc(batch->files, (batch->nfile + 256) * sizeof(char*));
+        if (!files) return -1;
+        batch->files = files;
+    }
+    batch->files[batch->nfile] = strdup(file);
+    return batch->files[batch->nfile] ? batch->nfile++ : -1;
+}
+
+// path is a directory, all .bmp files in it except dither outputs are taken,
+// otherwise it is a text file listing one bmp file per line.
+static int batch_load(BATCH *batch, char *path)
+{
+    char           file[PATH_MAX + 256];
+    struct stat    st;
+    struct dirent *ent;
+    DIR           *dir;
+    FILE          *fp;
+    int            len;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        dir = opendir(path);
+        if (!dir) return -1;
+        while ((ent = readdir(dir))) {
+            len = strlen(ent->d_name);
+            if (len < 4 || strcasecmp(ent->d_name + len - 4, ".bmp") != 0) continue;
+            if (strncmp(ent->d_name, "dither-", 7) == 0) continue;
+            snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+            if (batch_add_file(batch, file) < 0) break;
+        }
+        closedir(dir);
+        qsort(batch->files, batch->nfile, sizeof(char*), compare_file);
+    } else {
+        fp = fopen(path, "rb");
+        if (!fp) return -1;
+        while (fgets(file, sizeof(file), fp)) {
+            len = strlen(file);
+            while (len > 0 && (file[len-1] == '\n' || file[len-1] == '\r' || file[len-1] == ' ')) file[--len] = '\0';
+            if (len > 0 && batch_add_file(batch, file) < 0) break;
+        }
+        fclose(fp);
     }
-    *r = pbyte[x * 3 + 0 + y * pb->stride];
-    *g = pbyte[x * 3 + 1 + y * pb->stride];
-    *b = pbyte[x * 3 + 2 + y * pb->stride];
+    return 0;
 }
 
-static int find_closest_palette_color(uint8_t *palette, int palsize, int r, int g, int b)
+static void batch_free(BATCH *batch)
 {
-    int mindist = 0x7fffffff;
-    int closest = 0;
     int i;
+    for (i=0; i<batch->nfile; i++) free(batch->files[i]);
+    free(batch->files);
+    batch->files = NULL;
+    batch->nfile = 0;
+}
+
+static void* batch_proc(void *arg)
+{
+    BATCH   *batch = arg;
+    char     outfile[PATH_MAX];
+    COLORMAP map;
+    BMP      bmp, idx;
+    int64_t  npixel;
+    int      ret, i;
 
-    for (i=0; i<palsize; i++) {
-        int curdist = (r - palette[i*3+0]) * (r - palette[i*3+0])
-                    + (g - palette[i*3+1]) * (g - palette[i*3+1])
-                    + (b - palette[i*3+2]) * (b - palette[i*3+2]);
-        if (mindist > curdist) {
-            mindist = curdist;
-            closest = i;
+    colormap_fork(&map, batch->map);
+    while ((i = __atomic_fetch_add(&batch->nextfile, 1, __ATOMIC_RELAXED)) < batch->nfile) {
+        if (make_outfile(outfile, sizeof(outfile), batch->files[i]) < 0) {
+            printf("failed to make output file name: %s\n", batch->files[i]);
+            __atomic_add_fetch(&batch->nfailed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        memset(&bmp, 0, sizeof(bmp));
+        memset(&idx, 0, sizeof(idx));
+        if (batch->mapped) {
+            ret = mmap_bmp(&map, batch->od, batch->files[i], outfile, batch->dither, 1, &bmp);
+        } else if (batch->stream) {
+            ret = stream_bmp(&map, batch->od, batch->files[i], outfile, batch->dither, &bmp);
+        } else {
+            ret = bmp_load(&bmp, batch->files[i]);
+            if (ret == 0) ret = dither_loaded(&map, batch->od, batch->dither, 1, &bmp, &idx);
+            if (ret == 0) ret = save_loaded(&map, &bmp, &idx, outfile);
+        }
+        npixel = (int64_t)bmp.width * bmp.height;
+        bmp_free(&idx);
+        bmp_free(&bmp);
+
+        if (ret < 0) {
+            printf("failed to dither bmp: %s\n", batch->files[i]);
+            __atomic_add_fetch(&batch->nfailed, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&batch->npixel, npixel, __ATOMIC_RELAXED);
         }
     }
+    colormap_join(batch->map, &map);
+    return NULL;
+}
+
+static void batch_run(BATCH *batch, int nthread)
+{
+    pthread_t threads[256];
+    int       i;
 
-    return closest;
+    nthread = nthread < 256 ? nthread : 256;
+    for (i=1; i<nthread; i++) {
+        if (pthread_create(&threads[i], NULL, batch_proc, batch) != 0) break;
+    }
+    nthread = i;
+    batch_proc(batch);
+    for (i=1; i<nthread; i++) pthread_join(threads[i], NULL);
 }
+//-- batch
+
+//++ frames
+// dither a sequence of frames from stdin to stdout, raw rgb frames of a fixed
+// size or a ppm stream (P6, the size may change from frame to frame). the
+// frames go through FRAME_SLOTS buffers, a reader thread fills the next one
+// and a writer thread drains the previous one while this thread dithers.
+// indexed output is one byte per pixel for ppm (P5), packed rows for raw.
+// with incremental set only the part of a frame that can differ from the
+// previous one is dithered again, the rest comes from the cached output.
+#define FRAME_SLOTS  2
+#define FRAME_FREE   0
+#define FRAME_READ   1
+#define FRAME_DONE   2
+#define FRAME_MAX_PIXELS  (64 * 1024 * 1024) // larger frames are rejected, so bytes fit in an int
+
+typedef struct {
+    uint8_t  *in;
+    uint8_t  *out;
+    int       size;   // allocated pixels
+    int       width;
+    int       height;
+    int       state;
+    double    tready; // the frame has been read
+    double    tdither;
+    int64_t   npixel; // pixels dithered for this frame
+} FRAME;
 
-//++ octree
-typedef struct tagNODE {
-    int r;
-    int g;
-    int b;
-    int c;
-    struct tagNODE *child[8];
-} NODE;
+typedef struct {
+    uint8_t  *prev;   // previous input
+    uint8_t  *out;    // previous output
+    short    *erows;  // error entering each row, width * 3 for it and each row below, diffusion only
+    int       width;
+    int       height;
+} INCREMENTAL;
+
+typedef struct {
+    COLORMAP *map;
+    ORDERED  *od;
+    int       dither;
+    int       nthread;
+    int       ppm;
+    int       width;  // raw frame size
+    int       height;
+    FILE     *fpin;
+    FILE     *fpout;
+    FRAME     slots[FRAME_SLOTS];
+    int       nread;  // frames read so far, the total once eof is set
+    int       eof;
+    int       abort;
+    int       incremental;
+    INCREMENTAL incr;
+    int       nframe; // frames written
+    double    latsum;
+    double    latmax;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} FRAMES;
 
-static NODE* octree_create(uint8_t *pal, int size)
+static int ppm_token(FILE *fp)
 {
-    NODE *root = calloc(1, sizeof(NODE));
-    NODE *node = NULL;
-    int   r, g, b, i, j;
-    int   idx;
+    int c, v = 0, n = 0;
+    while ((c = getc(fp)) != EOF) {
+        if (c == '#') {
+            while ((c = getc(fp)) != EOF && c != '\n');
+        } else if (c >= '0' && c <= '9') {
+            v = v * 10 + c - '0';
+            n++;
+        } else if (n) {
+            return v; // the single whitespace after the maxval is eaten here
+        }
+    }
+    return n ? v : -1;
+}
 
-    for (i=0; i<size; i++) {
-        r = pal[i*3+0];
-        g = pal[i*3+1];
-        b = pal[i*3+2];
+// read the next frame into slot, 0 on success, -1 at the end of the stream
+static int frame_read(FRAMES *fr, FRAME *slot)
+{
+    int w = fr->width, h = fr->height, c, n;
 
-        node = root; // from root
-        for (j=1; j<=8; j++) {
-            idx = ((r >> (6 - j)) & (1 << 2))
-                | ((g >> (7 - j)) & (1 << 1))
-                | ((b >> (8 - j)) & (1 << 0));
-            if (node->child[idx] == NULL) {
-                node->child[idx]    = calloc(1, sizeof(NODE));
-                node->child[idx]->c = -1;  // i != -1 means it is a leaf
-            }
-            node = node->child[idx];
+    if (fr->ppm) {
+        while ((c = getc(fr->fpin)) != EOF && c != 'P');
+        if (c == EOF || getc(fr->fpin) != '6') return -1;
+        w = ppm_token(fr->fpin);
+        h = ppm_token(fr->fpin);
+        if (w <= 0 || h <= 0 || ppm_token(fr->fpin) != 255) {
+            fprintf(stderr, "frames: unsupported ppm header !\n");
+            return -1;
         }
+    }
+    if (w <= 0 || h <= 0 || (int64_t)w * h > FRAME_MAX_PIXELS) {
+        fprintf(stderr, "frames: unsupported frame size %dx%d !\n", w, h);
+        return -1;
+    }
+    n = w * h;
+    if (n > slot->size) {
+        free(slot->in );
+        free(slot->out);
+        slot->in   = malloc(n * 3);
+        slot->out  = malloc(n * 3);
+        slot->size = slot->in && slot->out ? n : 0;
+        if (!slot->size) return -1;
+    }
+    slot->width  = w;
+    slot->height = h;
+    return fread(slot->in, n * 3, 1, fr->fpin) == 1 ? 0 : -1;
+}
 
-        node->r = r;
-        node->g = g;
-        node->b = b;
-        node->c = i;
+static void frame_write(FRAMES *fr, FRAME *slot, uint8_t *line)
+{
+    int cdepth = index_depth(fr->map->size);
+    int stride = (slot->width * cdepth + 7) / 8;
+    int y;
+
+    if (fr->ppm) {
+        fprintf(fr->fpout, "P%d\n%d %d\n255\n", fr->map->indexed ? 5 : 6, slot->width, slot->height);
+        fwrite(slot->out, slot->width * slot->height * (fr->map->indexed ? 1 : 3), 1, fr->fpout);
+    } else if (fr->map->indexed) {
+        for (y=0; y<slot->height; y++) {
+            pack_row(slot->out + y * slot->width, line, slot->width, cdepth);
+            fwrite(line, stride, 1, fr->fpout);
+        }
+    } else {
+        fwrite(slot->out, slot->width * slot->height * 3, 1, fr->fpout);
     }
+    fflush(fr->fpout);
+}
+
+// wait until slot k is in state, 0 when it is, -1 when no such frame will come
+static int frame_wait(FRAMES *fr, int k, int state)
+{
+    FRAME *slot = &fr->slots[k % FRAME_SLOTS];
+    pthread_mutex_lock(&fr->lock);
+    while (slot->state != state && !fr->abort && !(fr->eof && k >= fr->nread)) {
+        pthread_cond_wait(&fr->cond, &fr->lock);
+    }
+    state = slot->state == state && !fr->abort ? 0 : -1;
+    pthread_mutex_unlock(&fr->lock);
+    return state;
+}
 
-    return root;
+static void frame_post(FRAMES *fr, int k, int state)
+{
+    pthread_mutex_lock(&fr->lock);
+    fr->slots[k % FRAME_SLOTS].state = state;
+    if (state == FRAME_READ) fr->nread = k + 1;
+    pthread_cond_broadcast(&fr->cond);
+    pthread_mutex_unlock(&fr->lock);
 }
 
-static void octree_destroy(NODE *root)
+static void frame_stop(FRAMES *fr, int eof)
 {
-    int  i;
-    for (i=0; i<8; i++) {
-        if (root->child[i]) {
-            octree_destroy(root->child[i]);
+    pthread_mutex_lock(&fr->lock);
+    if (eof) fr->eof   = 1;
+    else     fr->abort = 1;
+    pthread_cond_broadcast(&fr->cond);
+    pthread_mutex_unlock(&fr->lock);
+}
+
+static void* frame_reader(void *arg)
+{
+    FRAMES *fr = arg;
+    FRAME  *slot;
+    int     k;
+    for (k=0; frame_wait(fr, k, FRAME_FREE) == 0; k++) {
+        slot = &fr->slots[k % FRAME_SLOTS];
+        if (frame_read(fr, slot) < 0) break;
+        slot->tready = get_time_ms();
+        frame_post(fr, k, FRAME_READ);
+    }
+    frame_stop(fr, 1);
+    return NULL;
+}
+
+static void* frame_writer(void *arg)
+{
+    FRAMES  *fr   = arg;
+    FRAME   *slot;
+    uint8_t *line = NULL;
+    double   latency;
+    int      k, size = 0, failed;
+
+    for (k=0; frame_wait(fr, k, FRAME_DONE) == 0; k++) {
+        slot = &fr->slots[k % FRAME_SLOTS];
+        if (slot->width > size) {
+            free(line);
+            line = malloc(slot->width);
+            size = line ? slot->width : 0;
+            if (!line) break;
+        }
+        frame_write(fr, slot, line);
+        if (ferror(fr->fpout)) {
+            fprintf(stderr, "failed to write frame %d !\n", k);
+            break;
         }
+        latency = get_time_ms() - slot->tready;
+        fr->latsum += latency;
+        fr->latmax  = latency > fr->latmax ? latency : fr->latmax;
+        fr->nframe++;
+        fprintf(stderr, "frame %d: %dx%d, dither %.2f ms, latency %.2f ms, %lld pixels dithered\n",
+            k, slot->width, slot->height, slot->tdither, latency, (long long)slot->npixel);
+        frame_post(fr, k, FRAME_FREE);
     }
-    free(root);
+    pthread_mutex_lock(&fr->lock);
+    failed = k < fr->nread || !fr->eof;
+    pthread_mutex_unlock(&fr->lock);
+    if (failed) frame_stop(fr, 0); // output failed
+    free(line);
+    return NULL;
 }
 
-static void octree_traverse(NODE *node, int data[5])
+// first and last column that differ between rows a and b, -1 if none
+static int row_diff(const uint8_t *a, const uint8_t *b, int width, int *last)
 {
-    int i;
+    int first = -1, x;
+    for (x=0; x<width; x++, a+=3, b+=3) {
+        if (a[0] != b[0] || a[1] != b[1] || a[2] != b[2]) {
+            if (first < 0) first = x;
+            *last = x;
+        }
+    }
+    return first;
+}
+
+// dither src into dst reusing the previous frame, returns the pixels dithered or -1.
+// pixels of ordered and no dither are independent, only the changed spans are done,
+// aligned to the bayer matrix. error diffusion restarts at the first changed row with
+// the error that entered it last time, and stops below the last changed row as soon
+// as the error entering a row is the one of the previous frame, from there on the
+// input and the error are the same, so is the output.
+static int64_t dither_incremental(FRAMES *fr, BMP *src, BMP *dst)
+{
+    INCREMENTAL *ic  = &fr->incr;
+    COLORMAP    *map = fr->map;
+    int          w   = src->width, h = src->height;
+    int          px  = map->indexed ? 1 : 3;
+    int          ne  = w * 3 * (DIFFUSE_ROWS - 1); // error entering a row, its own and the rows below
+    int64_t      npixel = 0;
+    ERRROWS      er;
+    short       *saved;
+    int          y0 = -1, y1 = -1, xs, xe, y, i;
+    int          full = 0;
+    uint8_t     *sline;
 
-    if (node->c != -1) {
-        int curdist = (data[0] - node->r) * (data[0] - node->r)
-                    + (data[1] - node->g) * (data[1] - node->g)
-                    + (data[2] - node->b) * (data[2] - node->b);
-        if (data[3] > curdist) {
-            data[3] = curdist;
-            data[4] = node->c;
+    if (ic->width != w || ic->height != h) {
+        free(ic->prev );
+        free(ic->out  );
+        free(ic->erows);
+        memset(ic, 0, sizeof(INCREMENTAL));
+        ic->prev  = malloc((size_t)w * h * 3);
+        ic->out   = malloc((size_t)w * h * px);
+        ic->erows = fr->dither == DITHER_DIFFUSE ? malloc((size_t)ne * h * sizeof(short)) : NULL;
+        if (!ic->prev || !ic->out || (fr->dither == DITHER_DIFFUSE && !ic->erows)) return -1;
+        ic->width  = w;
+        ic->height = h;
+        full = 1;
+        y0   = 0;
+        y1   = h - 1;
+    } else {
+        for (y=0; y<h; y++) {
+            if (memcmp(ic->prev + y * w * 3, (uint8_t*)src->pdata + y * src->stride, w * 3) != 0) {
+                if (y0 < 0) y0 = y;
+                y1 = y;
+            }
         }
-        return;
     }
 
-    for (i=0; i<8; i++) {
-        if (node->child[i]) {
-            octree_traverse(node->child[i], data);
+    if (y0 >= 0 && fr->dither == DITHER_DIFFUSE) {
+        if (errrows_init(&er, w) < 0) return -1;
+        if (y0 > 0) {
+            saved = ic->erows + (size_t)y0 * ne;
+            for (i=0; i<DIFFUSE_ROWS-1; i++) memcpy(er.row[i], saved + i * w * 3, w * 3 * sizeof(short));
         }
+        for (y=y0; y<h; y++) {
+            int carry[DIFFUSE_CARRY] = {0};
+            saved = ic->erows + (size_t)y * ne;
+            if (y > y1) {
+                for (i=0; i<DIFFUSE_ROWS-1 && memcmp(er.row[i], saved + i * w * 3, w * 3 * sizeof(short)) == 0; i++);
+                if (i == DIFFUSE_ROWS - 1) break;
+            }
+            for (i=0; i<DIFFUSE_ROWS-1; i++) memcpy(saved + i * w * 3, er.row[i], w * 3 * sizeof(short));
+            diffuse_row(map, (uint8_t*)src->pdata + y * src->stride, ic->out + y * w * px, w, er.row, carry);
+            errrows_next(&er);
+            npixel += w;
+        }
+        free(er.buf);
+    } else if (y0 >= 0) {
+        for (y=y0; y<=y1; y++) {
+            sline = (uint8_t*)src->pdata + y * src->stride;
+            if (full) {
+                xs = 0;
+                xe = w - 1;
+            } else if ((xs = row_diff(ic->prev + y * w * 3, sline, w, &xe)) < 0) {
+                continue;
+            }
+            xs &= ~15; // bayer matrices are at most 16 wide
+            if (fr->dither == DITHER_ORDERED) {
+                ordered_row (map, fr->od, sline + xs * 3, ic->out + (y * w + xs) * px, xe + 1 - xs, y);
+            } else {
+                quantize_row(map, sline + xs * 3, ic->out + (y * w + xs) * px, xe + 1 - xs);
+            }
+            npixel += xe + 1 - xs;
+        }
+    }
+
+    for (y=0; y<h; y++) {
+        if (y >= y0 && y <= y1) memcpy(ic->prev + y * w * 3, (uint8_t*)src->pdata + y * src->stride, w * 3);
+        memcpy((uint8_t*)dst->pdata + y * dst->stride, ic->out + y * w * px, w * px);
     }
+    return npixel;
 }
 
-static int octree_find_color(NODE *root, int r, int g, int b)
+// returns the number of frames written, or -1 if the pipeline could not start
+static int dither_frames(FRAMES *fr)
 {
-    NODE *node    = root;
-    int   idx     = 0;
-    int   data[5] = { r, g, b, 0x7fffffff, -1 };
-    int   i;
+    pthread_t reader, writer;
+    FRAME    *slot;
+    BMP       src, dst;
+    double    tick;
+    int       k;
 
-    for (i=1; i<=8; i++) {
-        idx = ((r >> (6 - i)) & (1 << 2))
-            | ((g >> (7 - i)) & (1 << 1))
-            | ((b >> (8 - i)) & (1 << 0));
-        if (!node->child[idx]) break;
-        node = node->child[idx];
+    pthread_mutex_init(&fr->lock, NULL);
+    pthread_cond_init (&fr->cond, NULL);
+    if (pthread_create(&reader, NULL, frame_reader, fr) != 0) return -1;
+    if (pthread_create(&writer, NULL, frame_writer, fr) != 0) {
+        frame_stop(fr, 0);
+        pthread_join(reader, NULL);
+        return -1;
     }
 
-    octree_traverse(node, data);
-    return data[4];
+    for (k=0; frame_wait(fr, k, FRAME_READ) == 0; k++) {
+        slot       = &fr->slots[k % FRAME_SLOTS];
+        tick       = get_time_ms();
+        src.width  = dst.width  = slot->width;
+        src.height = dst.height = slot->height;
+        src.stride = slot->width * 3;
+        dst.stride = slot->width * (fr->map->indexed ? 1 : 3);
+        src.pdata  = slot->in;
+        dst.pdata  = slot->out;
+        if (fr->incremental) {
+            slot->npixel = dither_incremental(fr, &src, &dst);
+        } else {
+            slot->npixel = dither_image(fr->map, fr->od, fr->dither, fr->nthread, &src, &dst) < 0 ? -1 : (int64_t)src.width * src.height;
+        }
+        if (slot->npixel < 0) {
+            fprintf(stderr, "failed to dither frame %d !\n", k);
+            frame_stop(fr, 0);
+            break;
+        }
+        slot->tdither = get_time_ms() - tick;
+        frame_post(fr, k, FRAME_DONE);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    for (k=0; k<FRAME_SLOTS; k++) {
+        free(fr->slots[k].in );
+        free(fr->slots[k].out);
+    }
+    free(fr->incr.prev );
+    free(fr->incr.out  );
+    free(fr->incr.erows);
+    pthread_cond_destroy (&fr->cond);
+    pthread_mutex_destroy(&fr->lock);
+    return fr->nframe;
 }
-//-- octree
+//-- frames
 
 int main(int argc, char *argv[])
 {
     char    bmpfile[PATH_MAX] = "test.bmp";
     char    palfile[PATH_MAX] = "palette.pal";
-    char    outfile[PATH_MAX] = "dither-";
+    char    outfile[PATH_MAX] = "";
     uint8_t palette[256*3]    = { 0, 0, 0, 255, 255, 255 };
     int     palsize =  2;
     BMP     bmp     = {0};
+    BMP     idx     = {0};
     FILE   *fp      = NULL;
-    NODE   *octree  = NULL;
-    int     dither  =  1;
+    COLORMAP map    = {0};
+    CPAL    cpal    = {0};
+    int     kernel  =  0;
+    int     simd    =  NEAREST_AUTO;
+    int     lutbits =  0;
+    int     exact   =  0;
+    int     stream  =  0;
+    int     mapped  =  0;
+    int     indexed =  0;
+    int     nthread =  1;
+    int     dither  =  DITHER_DIFFUSE;
+    ORDERED ordered = {0};
+    int     odsize  =  8;
+    BATCH   batch   = {0};
+    int     isbatch =  0;
+    FRAMES  frames  = {0};
+    int     isframes=  0;
+    int     stats   =  0;
     int     ret     =  0;
     int     i       =  0;
-    int     x, y;
+    int     n       =  0;
+    double  tick, tload = 0, tpal = 0, tbuild = 0, tdither = 0, tsave = 0;
+    int64_t npixel  =  0;
 
     // handle commmand line
-    if (argc >= 4) {
-        if (strcmp("nodither", argv[3]) == 0) dither = 0;
-        printf("dither: %d\n", dither);
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--lut") == 0 && i + 1 < argc) {
+            lutbits = atoi(argv[++i]);
+            lutbits = lutbits < LUT_MAX_BITS ? lutbits : LUT_MAX_BITS;
+        } else if (strcmp(argv[i], "--exact") == 0) {
+            exact = 1;
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            simd = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            mapped = 1;
+        } else if (strcmp(argv[i], "--indexed") == 0) {
+            indexed = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            nthread = atoi(argv[++i]);
+            nthread = nthread > 1 ? nthread : 1;
+        } else if (strcmp(argv[i], "--ordered") == 0 && i + 1 < argc) {
+            dither = DITHER_ORDERED;
+            odsize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            if ((kernel = kernel_find(argv[++i])) < 0) {
+                printf("unknown kernel %s !\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            isbatch = 1;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            isframes = 1;
+            frames.ppm = strcmp(argv[++i], "ppm") == 0;
+            if (!frames.ppm && sscanf(argv[i], "%dx%d", &frames.width, &frames.height) != 2) {
+                printf("frames must be ppm or WxH !\n");
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            frames.incremental = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "nodither") == 0) {
+            dither = DITHER_NONE;
+        } else if (n == 0) {
+            strcpy(bmpfile, argv[i]); n++;
+        } else if (n == 1) {
+            strcpy(palfile, argv[i]); n++;
+        }
     }
-    if (argc >= 3) {
-        strcpy(palfile, argv[2]);
+    if (isframes) {
+        // frames go to stdout, so everything printed goes to stderr
+        if (n == 1) strcpy(palfile, bmpfile);
+#ifdef _WIN32
+        _setmode(_fileno(stdin ), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        fflush(stdout);
+        frames.fpin  = stdin;
+        frames.fpout = fdopen(dup(fileno(stdout)), "wb");
+        if (!frames.fpout || dup2(fileno(stderr), fileno(stdout)) < 0) return 0;
+        setvbuf(stdout, NULL, _IONBF, 0);
     }
-    if (argc >= 2) {
-        strcpy(bmpfile, argv[1]);
+    printf("dither: %d\n", dither);
+    if (!isframes && !isbatch && make_outfile(outfile, sizeof(outfile), bmpfile) < 0) {
+        printf("failed to make output file name: %s\n", bmpfile);
+        goto end;
     }
-    strcat(outfile, bmpfile);
 
-    // load bmp file
-    ret = bmp_load(&bmp, bmpfile);
-    if (ret < 0) {
-        printf("failed to load bmp file: %s\n", bmpfile);
-        goto end;
+    // load bmp file or file list
+    tick = get_time_ms();
+    if (isframes) {
+        // nothing to load, frames come from stdin
+    } else if (isbatch) {
+        if (batch_load(&batch, bmpfile) < 0) {
+            printf("failed to load file list: %s\n", bmpfile);
+            goto end;
+        }
+    } else if (!stream && !mapped) {
+        ret = bmp_load(&bmp, bmpfile);
+        if (ret < 0) {
+            printf("failed to load bmp file: %s\n", bmpfile);
+            goto end;
+        }
     }
+    tload = get_time_ms() - tick;
 
-    // load palette
-    fp = fopen(palfile, "rb");
-    if (fp) {
+    // load palette, a compiled one is mapped and read in place
+    tick = get_time_ms();
+    i    = 0;
+    ret  = cpal_open(&cpal, palfile);
+    if (ret == -2) {
+        printf("failed to load compiled palette: %s !\n", palfile);
+        goto end;
+    } else if (ret == 0) {
+        palsize = cpal.hdr->size;
+        memcpy(palette, cpal.hdr->pal, palsize * 3);
+        printf("palette: compiled, %d colors, hash %016llx, lut %d bits\n",
+            palsize, (unsigned long long)cpal.hdr->hash, cpal.hdr->lutbits);
+    } else if ((fp = fopen(palfile, "rb"))) {
         while (!feof(fp) && i<256) {
             int r, g, b;
             ret = fscanf(fp, "%d %d %d", &r, &g, &b);
@@ -315,80 +1057,126 @@ int main(int argc, char *argv[])
         fclose(fp);
         palsize = i;
     }
-    // create octree
-    octree = octree_create(palette, palsize);
+    tpal = get_time_ms() - tick;
+
+    // create lut, kdtree or simd search, the lut of a compiled palette
+    // is used unless --lut or --exact ask for another one
+    if (cpal.lut && lutbits == 0) lutbits = cpal.hdr->lutbits;
+    if (cpal.lut && lutbits == (int)cpal.hdr->lutbits) exact = exact || cpal.hdr->exact;
+    tick = get_time_ms();
+    if (cpal.hdr && lutbits == (int)cpal.hdr->lutbits && (!cpal.lut || exact == (int)cpal.hdr->exact)) {
+        ret = colormap_init_cpal(&map, &cpal, simd);
+    } else {
+        ret = colormap_init(&map, palette, palsize, simd, lutbits, exact);
+    }
+    if (ret < 0) {
+        printf("failed to create %s !\n", lutbits > 0 ? "lut" : "kdtree");
+        goto end;
+    }
+    tbuild = get_time_ms() - tick;
+    if (map.lut) {
+        printf("lut %s: %d bits, %d cells, %d refined, %.2f ms\n", map.lutref ? "mapped" : "build",
+            lutbits, 1 << (lutbits * 3), map.lut->nref, tbuild);
+    } else {
+        printf("nearest: %s\n", map.kdtree ? "kdtree" : nearest_name(map.near));
+    }
 
     // do dither
-    for (y=0; y<bmp.height; y++) {
-        for (x=0; x<bmp.width; x++) {
-            int oldr, oldg, oldb;
-            int newr, newg, newb;
-            int errr, errg, errb;
-
-            // for pixel (x, y)
-            bmp_getpixel(&bmp, x, y, &oldr, &oldg, &oldb);
-            if (dither) {
-                i    = octree_find_color(octree, oldr, oldg, oldb);
-                newr = palette[i * 3 + 0];
-                newg = palette[i * 3 + 1];
-                newb = palette[i * 3 + 2];
-                bmp_setpixel(&bmp, x, y, newr, newg, newb);
-
-                // calculate the error
-                errr = oldr - newr;
-                errg = oldg - newg;
-                errb = oldb - newb;
-
-                // for pixel (x+1, y)
-                bmp_getpixel(&bmp, x+1, y, &newr, &newg, &newb);
-                newr += errr * 7 / 16;
-                newg += errg * 7 / 16;
-                newb += errb * 7 / 16;
-                bmp_setpixel(&bmp, x+1, y, newr, newg, newb);
-
-                // for pixel (x-1, y+1)
-                bmp_getpixel(&bmp, x-1, y+1, &newr, &newg, &newb);
-                newr += errr * 3 / 16;
-                newg += errg * 3 / 16;
-                newb += errb * 3 / 16;
-                bmp_setpixel(&bmp, x-1, y+1, newr, newg, newb);
-
-                // for pixel (x, y+1)
-                bmp_getpixel(&bmp, x, y+1, &newr, &newg, &newb);
-                newr += errr * 5 / 16;
-                newg += errg * 5 / 16;
-                newb += errb * 5 / 16;
-                bmp_setpixel(&bmp, x, y+1, newr, newg, newb);
-
-                // for pixel (x+1, y+1)
-                bmp_getpixel(&bmp, x+1, y+1, &newr, &newg, &newb);
-                newr += errr * 1 / 16;
-                newg += errg * 1 / 16;
-                newb += errb * 1 / 16;
-                bmp_setpixel(&bmp, x+1, y+1, newr, newg, newb);
-            } else {
-                if (0) {
-                    i = octree_find_color(octree, oldr, oldg, oldb);
-                } else {
-                    i = find_closest_palette_color(palette, palsize, oldr, oldg, oldb);
-                }
-                bmp_setpixel(&bmp, x, y, palette[i * 3 + 0], palette[i * 3 + 1], palette[i * 3 + 2]);
-            }
+    map.stats  = stats;
+    map.indexed= indexed;
+    map.kernel = kernel;
+    if (indexed) printf("indexed: %d bits\n", index_depth(palsize));
+    if (dither == DITHER_DIFFUSE) printf("kernel: %s\n", kernel_name(kernel));
+    if (dither == DITHER_ORDERED) {
+        ordered_init(&ordered, odsize, palette, palsize);
+        printf("ordered: %dx%d bayer, spread %d\n", ordered.size, ordered.size, ordered.spread);
+    }
+    tick = get_time_ms();
+    ret  = 0;
+    if (isframes) {
+        frames.map     = &map;
+        frames.od      = &ordered;
+        frames.dither  = dither;
+        frames.nthread = nthread;
+        ret     = dither_frames(&frames);
+        tdither = get_time_ms() - tick;
+        if (ret < 0) {
+            printf("failed to start frame threads !\n");
+        } else {
+            printf("frames: %d, %.2f s, %.1f fps, latency avg %.2f ms, max %.2f ms\n",
+                ret, tdither / 1000, ret * 1000 / tdither, ret ? frames.latsum / ret : 0, frames.latmax);
+        }
+        if (frames.fpout) fclose(frames.fpout);
+        goto end;
+    } else if (isbatch) {
+        batch.map    = &map;
+        batch.od     = &ordered;
+        batch.dither = dither;
+        batch.stream = stream;
+        batch.mapped = mapped;
+        batch_run(&batch, nthread);
+        tdither = get_time_ms() - tick;
+        npixel  = batch.npixel;
+        tick    = tdither / 1000;
+        printf("batch: %d files, %d failed, %d threads, %.2f s, %.1f images/s, %.2f MPix/s\n",
+            batch.nfile, batch.nfailed, nthread, tick, (batch.nfile - batch.nfailed) / tick, batch.npixel / tick / 1000000);
+        goto end;
+    } else if (stream || mapped) {
+        if (mapped) {
+            ret = mmap_bmp(&map, &ordered, bmpfile, outfile, dither, nthread, &bmp);
+        } else {
+            ret = stream_bmp(&map, &ordered, bmpfile, outfile, dither, &bmp);
+        }
+        if (ret < 0) {
+            printf("failed to %s dither bmp: %s\n", mapped ? "mmap" : "stream", bmpfile);
+        } else {
+            tdither = get_time_ms() - tick;
+            npixel  = (int64_t)bmp.width * bmp.height;
+            printf("dither: %dx%d, %.2f ms\n", bmp.width, bmp.height, tdither);
+            printf("save dither bmp ok !\n");
         }
+        goto end;
+    } else {
+        ret = dither_loaded(&map, &ordered, dither, nthread, &bmp, &idx);
+    }
+    if (ret < 0) {
+        printf("failed to allocate error buffer !\n");
+        goto end;
     }
 
-    // destroy octree
-    octree_destroy(octree);
+    tdither = get_time_ms() - tick;
+    npixel  = (int64_t)bmp.width * bmp.height;
+    printf("dither: %dx%d, %.2f ms\n", bmp.width, bmp.height, tdither);
 
     // save dither bmp
-    ret = bmp_save(&bmp, outfile);
+    tick = get_time_ms();
+    ret  = save_loaded(&map, &bmp, &idx, outfile);
     if (ret < 0) {
         printf("failed to save dither bmp !\n");
     } else {
         printf("save dither bmp ok !\n");
     }
+    tsave = get_time_ms() - tick;
 
 end:
+    // stats go to stderr so they never mix with the normal output
+    if (stats) {
+        fprintf(stderr, "stats: load: %.2f ms\n"   , tload  );
+        fprintf(stderr, "stats: palette: %d colors, %.2f ms\n", palsize, tpal);
+        fprintf(stderr, "stats: build: %s, %.2f ms\n", map.lut ? "lut" : map.kdtree ? "kdtree" : map.near ? nearest_name(map.near) : "none", tbuild);
+        fprintf(stderr, "stats: dither: %.2f ms\n" , tdither);
+        fprintf(stderr, "stats: save: %.2f ms\n"   , tsave  );
+        fprintf(stderr, "stats: pixels: %lld, %.2f MPix/s\n", (long long)npixel, tdither > 0 ? npixel / tdither / 1000 : 0);
+        fprintf(stderr, "stats: lookups: %lld, %.2f visits/lookup\n", (long long)map.lookups, map.lookups ? (double)map.visits / map.lookups : 0);
+        if (map.lut   ) fprintf(stderr, "stats: lut: %d cells, %d refined, %lld refine lookups\n", 1 << (lutbits * 3), map.lut->nref, (long long)map.refines);
+        if (map.kdtree) fprintf(stderr, "stats: kdtree: %d nodes\n", map.kdtree->size);
+        fprintf(stderr, "stats: peak memory: %ld KB\n", get_peak_mem_kb());
+    }
+    // destroy lookup
+    colormap_free(&map);
+    cpal_close(&cpal);
+    batch_free(&batch);
+    bmp_free(&idx);
     bmp_free(&bmp);
     return 0;
 }
@@ -0,0 +1,283 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libdither.h"
+#include "ditherd.h"
+
+// client of ditherd, sends a 24bit bmp with a palette file or a palette id
+// of the server, writes the dithered bmp, or prints the server counters.
+
+#pragma pack(1)
+typedef struct {
+    uint16_t  bfType;
+    uint32_t  bfSize;
+    uint16_t  bfReserved1;
+    uint16_t  bfReserved2;
+    uint32_t  bfOffBits;
+    uint32_t  biSize;
+    uint32_t  biWidth;
+    uint32_t  biHeight;
+    uint16_t  biPlanes;
+    uint16_t  biBitCount;
+    uint32_t  biCompression;
+    uint32_t  biSizeImage;
+    uint32_t  biXPelsPerMeter;
+    uint32_t  biYPelsPerMeter;
+    uint32_t  biClrUsed;
+    uint32_t  biClrImportant;
+} BMPFILEHEADER;
+#pragma pack()
+
+static double get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int read_full(int fd, void *buf, size_t size)
+{
+    uint8_t *p = buf;
+    ssize_t  n;
+    while (size > 0) {
+        n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; size -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    ssize_t        n;
+    while (size > 0) {
+        n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; size -= n;
+    }
+    return 0;
+}
+
+//++ bmp file
+// pixels are kept top row first without padding, as the protocol sends them
+static uint8_t* bmp_read(char *file, int *w, int *h)
+{
+    BMPFILEHEADER header = {0};
+    FILE         *fp     = fopen(file, "rb");
+    uint8_t      *pixels = NULL;
+    int           stride, y, row;
+
+    if (!fp) return NULL;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.biBitCount != 24 || (int32_t)header.biWidth <= 0) goto done;
+    *w     = header.biWidth;
+    *h     = abs((int32_t)header.biHeight);
+    stride = (*w * 3 + 3) & ~3;
+    pixels = malloc((size_t)stride * *h);
+    if (!pixels) goto done;
+    for (y=0; y<*h; y++) {
+        row = (int32_t)header.biHeight < 0 ? y : *h - 1 - y;
+        fseek(fp, header.bfOffBits + (long)stride * row, SEEK_SET);
+        if (fread(pixels + (size_t)*w * 3 * y, *w * 3, 1, fp) != 1) {
+            free(pixels);
+            pixels = NULL;
+            break;
+        }
+    }
+done:
+    fclose(fp);
+    return pixels;
+}
+
+// bpp 3 for a 24bit bmp, 1 for an 8bit one with pal as the colour table
+static int bmp_write(char *file, uint8_t *pixels, int w, int h, int bpp, uint8_t *pal, int palsize)
+{
+    BMPFILEHEADER header = {0};
+    uint8_t       table[256 * 4] = {0};
+    uint8_t       pad[4] = {0};
+    FILE         *fp;
+    int           stride = (w * bpp + 3) & ~3;
+    int           ntable = bpp == 1 ? 256 : 0;
+    int           i, y;
+
+    fp = fopen(file, "wb");
+    if (!fp) return -1;
+    for (i=0; i<palsize && i<ntable; i++) memcpy(table + i * 4, pal + i * 3, 3);
+    header.bfType     = ('B' << 0) | ('M' << 8);
+    header.bfOffBits  = sizeof(header) + ntable * 4;
+    header.bfSize     = header.bfOffBits + stride * h;
+    header.biSize     = 40;
+    header.biWidth    = w;
+    header.biHeight   = h;
+    header.biPlanes   = 1;
+    header.biBitCount = bpp * 8;
+    header.biSizeImage= stride * h;
+    header.biClrUsed  = ntable;
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(table, ntable * 4, 1, fp);
+    for (y=h-1; y>=0; y--) {
+        fwrite(pixels + (size_t)w * bpp * y, w * bpp, 1, fp);
+        fwrite(pad, stride - w * bpp, 1, fp);
+    }
+    fclose(fp);
+    return 0;
+}
+//-- bmp file
+
+static int load_pal(char *file, uint8_t *pal)
+{
+    FILE *fp = fopen(file, "rb");
+    int   r, g, b, n = 0;
+    if (!fp) return -1;
+    while (n < 256 && fscanf(fp, "%d %d %d", &r, &g, &b) == 3) {
+        pal[n * 3 + 0] = r;
+        pal[n * 3 + 1] = g;
+        pal[n * 3 + 2] = b;
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+// one request, the reply payload is returned in a malloc'ed buffer
+static uint8_t* request(char *sock, DREQ *req, uint8_t *pal, uint8_t *pixels, DRESP *resp)
+{
+    struct sockaddr_un addr = {0};
+    uint8_t           *data = NULL;
+    int                fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("failed to connect to %s !\n", sock);
+        goto done;
+    }
+    if (write_full(fd, req, sizeof(DREQ)) < 0
+     || write_full(fd, pal, req->palsize * 3) < 0
+     || write_full(fd, pixels, (size_t)req->width * req->height * 3) < 0
+     || read_full(fd, resp, sizeof(DRESP)) < 0 || resp->magic != DITHERD_MAGIC) {
+        printf("failed to talk to ditherd !\n");
+        goto done;
+    }
+    data = malloc(resp->size + 1);
+    if (data && read_full(fd, data, resp->size) < 0) {
+        free(data);
+        data = NULL;
+    }
+    if (data) data[resp->size] = '\0';
+
+done:
+    if (fd >= 0) close(fd);
+    return data;
+}
+
+int main(int argc, char *argv[])
+{
+    DREQ     req    = {0};
+    DRESP    resp   = {0};
+    uint8_t  pal[256 * 3];
+    uint8_t *pixels = NULL;
+    uint8_t *out    = NULL;
+    char    *sock   = DITHERD_SOCKET;
+    char    *files[3];
+    int      repeat = 1;
+    int      stats  = 0;
+    int      ret    = 1;
+    int      w = 0, h = 0, n = 0, i;
+    double   tick, ms, total = 0, best = 0;
+
+    req.magic = DITHERD_MAGIC;
+    req.type  = DITHERD_DITHER;
+    req.mode  = LIBDITHER_DIFFUSE;
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            sock = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            snprintf(req.kernel, sizeof(req.kernel), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--ordered") == 0 && i + 1 < argc) {
+            req.mode    = LIBDITHER_ORDERED;
+            req.ordered = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lut") == 0 && i + 1 < argc) {
+            req.lutbits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--indexed") == 0) {
+            req.indexed = 1;
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+            repeat = repeat > 1 ? repeat : 1;
+        } else if (strcmp(argv[i], "nodither") == 0) {
+            req.mode = LIBDITHER_NONE;
+        } else if (n < 3) {
+            files[n++] = argv[i];
+        }
+    }
+
+    if (stats) {
+        req.type = DITHERD_STATS;
+        out = request(sock, &req, pal, NULL, &resp);
+        if (out) printf("%s", out);
+        ret = !out;
+        free(out);
+        return ret;
+    }
+    if (n < 3) {
+        printf("usage: ditherc [--socket path] in.bmp out.bmp palette.pal|palette-id [--kernel name] [--ordered N]\n");
+        printf("               [nodither] [--lut N] [--indexed] [--repeat N]\n");
+        printf("       ditherc [--socket path] --stats\n");
+        return 0;
+    }
+
+    // an existing file is sent as palette data, anything else names a palette of the server
+    if (access(files[2], F_OK) == 0) {
+        req.palsize = load_pal(files[2], pal);
+        if ((int)req.palsize <= 0) {
+            printf("failed to load palette: %s\n", files[2]);
+            return 1;
+        }
+    } else {
+        snprintf(req.palid, sizeof(req.palid), "%s", files[2]);
+        if (req.indexed) {
+            printf("--indexed needs a palette file for the colour table !\n");
+            return 1;
+        }
+    }
+    pixels = bmp_read(files[0], &w, &h);
+    if (!pixels) {
+        printf("failed to load bmp file: %s\n", files[0]);
+        return 1;
+    }
+    req.width  = w;
+    req.height = h;
+
+    for (i=0; i<repeat; i++) {
+        free(out);
+        tick = get_time_ms();
+        out  = request(sock, &req, pal, pixels, &resp);
+        ms   = get_time_ms() - tick;
+        if (!out) break;
+        if (resp.status != 0) {
+            printf("ditherd: %s\n", out);
+            break;
+        }
+        total += ms;
+        best   = i == 0 || ms < best ? ms : best;
+    }
+    if (out && resp.status == 0) {
+        printf("ditherc: %dx%d, %d requests, avg %.2f ms, best %.2f ms\n", w, h, i, total / i, best);
+        ret = bmp_write(files[1], out, w, h, resp.bpp, pal, req.palsize) < 0;
+        if (ret) printf("failed to save bmp: %s\n", files[1]);
+    }
+    free(out);
+    free(pixels);
+    return ret;
+}
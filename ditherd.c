@@ -0,0 +1,493 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "libdither.h"
+#include "ditherd.h"
+
+// dither daemon, the palette lookups stay built between requests in an lru
+// cache, connections are queued by the accepting thread and served by a pool
+// of workers, each request is dithered by a single worker.
+#define CACHE_DEF     16
+#define WORKERS_DEF   4
+#define QUEUE_MAX     256
+#define LAT_SAMPLES   4096
+#define TIMEOUT_DEF   10   // seconds a connection may stall on a read or a write
+#define BACKOFF_MS    100  // wait after accept fails for lack of descriptors or memory
+
+static char g_sockpath[sizeof(((struct sockaddr_un*)0)->sun_path)] = DITHERD_SOCKET;
+
+static double get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// a socket timeout ends the loop like an error, read and write fail with EAGAIN
+static int read_full(int fd, void *buf, size_t size)
+{
+    uint8_t *p = buf;
+    ssize_t  n;
+    while (size > 0) {
+        n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; size -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    ssize_t        n;
+    while (size > 0) {
+        n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; size -= n;
+    }
+    return 0;
+}
+
+//++ cache
+// the key holds everything the context is built from, it is zeroed before it
+// is filled so it can be hashed and compared as bytes. an entry evicted while
+// a worker uses it is unlinked and freed by the last release.
+typedef struct {
+    char     palid[64];
+    uint8_t  pal[256 * 3];
+    int      palsize;
+    int      mode;
+    int      ordered;
+    int      lutbits;
+    int      indexed;
+    char     kernel[16];
+} CKEY;
+
+typedef struct tagCENTRY {
+    CKEY              key;
+    uint64_t          hash;
+    LIBDITHER        *ctx;
+    int               refs;
+    int               linked;
+    struct tagCENTRY *prev;
+    struct tagCENTRY *next;
+} CENTRY;
+
+typedef struct {
+    CENTRY          *head; // most recently used
+    CENTRY          *tail;
+    int              count;
+    int              max;
+    char            *paldir;
+    pthread_mutex_t  lock;
+} CACHE;
+
+static uint64_t fnv1a(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t       h = 14695981039346656037ULL;
+    while (size--) h = (h ^ *p++) * 1099511628211ULL;
+    return h;
+}
+
+static void cache_unlink(CACHE *cache, CENTRY *e)
+{
+    if (e->prev) e->prev->next = e->next; else cache->head = e->next;
+    if (e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+    e->prev = e->next = NULL;
+    e->linked = 0;
+    cache->count--;
+}
+
+static void cache_push(CACHE *cache, CENTRY *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head) cache->head->prev = e; else cache->tail = e;
+    cache->head = e;
+    e->linked = 1;
+    cache->count++;
+}
+
+static void centry_free(CENTRY *e)
+{
+    libdither_destroy(e->ctx);
+    free(e);
+}
+
+// palette ids name a file in the palette directory, nothing that leaves it
+static int load_palid(CACHE *cache, char *palid, uint8_t *pal)
+{
+    char  file[PATH_MAX];
+    FILE *fp;
+    int   r, g, b, n = 0;
+
+    if (!palid[0] || strchr(palid, '/') || strstr(palid, "..")) return -1;
+    snprintf(file, sizeof(file), "%s/%s.pal", cache->paldir, palid);
+    fp = fopen(file, "rb");
+    if (!fp) return -1;
+    while (n < 256 && fscanf(fp, "%d %d %d", &r, &g, &b) == 3) {
+        pal[n * 3 + 0] = r;
+        pal[n * 3 + 1] = g;
+        pal[n * 3 + 2] = b;
+        n++;
+    }
+    fclose(fp);
+    return n > 0 ? n : -1;
+}
+
+// returns the entry with a reference held, *hit tells if it was cached
+static CENTRY* cache_get(CACHE *cache, CKEY *key, int *hit, int *evicted)
+{
+    LIBDITHER_OPTS opts;
+    CENTRY        *e, *old = NULL;
+    uint64_t       hash = fnv1a(key, sizeof(CKEY));
+    uint8_t        pal[256 * 3];
+    int            palsize;
+
+    *hit = 1;
+    *evicted = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (e=cache->head; e && (e->hash != hash || memcmp(&e->key, key, sizeof(CKEY)) != 0); e=e->next);
+    if (e) {
+        cache_unlink(cache, e);
+        cache_push(cache, e);
+        e->refs++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (e) return e;
+
+    // build outside the lock, a request for the same key meanwhile builds its own
+    *hit = 0;
+    if (key->palsize > 0) {
+        memcpy(pal, key->pal, key->palsize * 3);
+        palsize = key->palsize;
+    } else if ((palsize = load_palid(cache, key->palid, pal)) < 0) {
+        return NULL;
+    }
+    libdither_defaults(&opts);
+    opts.mode    = key->mode;
+    opts.kernel  = key->kernel[0] ? key->kernel : NULL;
+    opts.ordered = key->ordered;
+    opts.lutbits = key->lutbits;
+    opts.indexed = key->indexed;
+    e = calloc(1, sizeof(CENTRY));
+    if (!e) return NULL;
+    e->key  = *key;
+    e->hash = hash;
+    e->refs = 1;
+    e->ctx  = libdither_create(pal, palsize, &opts);
+    if (!e->ctx) {
+        free(e);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache_push(cache, e);
+    if (cache->count > cache->max) {
+        old = cache->tail;
+        cache_unlink(cache, old);
+        *evicted = 1;
+        if (old->refs > 0) old = NULL; // freed by its last release
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (old) centry_free(old);
+    return e;
+}
+
+static void cache_release(CACHE *cache, CENTRY *e)
+{
+    int dead;
+    pthread_mutex_lock(&cache->lock);
+    dead = --e->refs == 0 && !e->linked;
+    pthread_mutex_unlock(&cache->lock);
+    if (dead) centry_free(e);
+}
+//-- cache
+
+//++ stats
+typedef struct {
+    int64_t  requests;
+    int64_t  errors;
+    int64_t  hits;
+    int64_t  misses;
+    int64_t  evictions;
+    int      depth;    // connections accepted and not yet taken by a worker
+    int      maxdepth;
+    float    lat[LAT_SAMPLES]; // ring of the last latencies in ms, accept to reply
+    int64_t  nlat;
+    pthread_mutex_t lock;
+} STATS;
+
+static int compare_float(const void *a, const void *b)
+{
+    float fa = *(float*)a, fb = *(float*)b;
+    return fa < fb ? -1 : fa > fb;
+}
+
+// percentiles of the latency ring, sorted on request
+static int stats_text(STATS *st, CACHE *cache, char *buf, int size)
+{
+    float   sorted[LAT_SAMPLES];
+    int64_t requests, errors, hits, misses, evictions;
+    int     depth, maxdepth, count, n, len;
+
+    pthread_mutex_lock(&st->lock);
+    requests = st->requests;
+    errors   = st->errors;
+    hits     = st->hits;
+    misses   = st->misses;
+    evictions= st->evictions;
+    depth    = st->depth;
+    maxdepth = st->maxdepth;
+    n        = st->nlat < LAT_SAMPLES ? (int)st->nlat : LAT_SAMPLES;
+    memcpy(sorted, st->lat, n * sizeof(float));
+    pthread_mutex_unlock(&st->lock);
+    pthread_mutex_lock(&cache->lock);
+    count    = cache->count;
+    pthread_mutex_unlock(&cache->lock);
+
+    qsort(sorted, n, sizeof(float), compare_float);
+    len = snprintf(buf, size,
+        "requests: %lld, errors: %lld\n"
+        "queue: depth %d, max %d\n"
+        "cache: %d of %d entries, %lld hits, %lld misses, %.1f%% hit rate, %lld evictions\n"
+        "latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms, last %d requests\n",
+        (long long)requests, (long long)errors, depth, maxdepth,
+        count, cache->max, (long long)hits, (long long)misses,
+        hits + misses ? 100.0 * hits / (hits + misses) : 0, (long long)evictions,
+        n ? sorted[n * 50 / 100] : 0, n ? sorted[n * 90 / 100] : 0, n ? sorted[n * 99 / 100] : 0, n ? sorted[n - 1] : 0, n);
+    return len < size ? len : size - 1;
+}
+//-- stats
+
+//++ server
+typedef struct {
+    int     fd;
+    double  tick; // accept time
+} CONN;
+
+typedef struct {
+    CACHE           cache;
+    STATS           stats;
+    CONN            queue[QUEUE_MAX];
+    int             qhead;
+    int             qcount;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} SERVER;
+
+static int reply(int fd, int status, int width, int height, int bpp, const void *data, int size)
+{
+    DRESP resp = { DITHERD_MAGIC, status, width, height, bpp, size };
+    if (write_full(fd, &resp, sizeof(resp)) < 0) return -1;
+    return size > 0 ? write_full(fd, data, size) : 0;
+}
+
+static int reply_error(int fd, char *msg)
+{
+    reply(fd, -1, 0, 0, 0, msg, strlen(msg));
+    return -1;
+}
+
+static int serve(SERVER *sv, int fd)
+{
+    DREQ      req;
+    CKEY      key;
+    CENTRY   *e   = NULL;
+    uint8_t  *in  = NULL;
+    uint8_t  *out = NULL;
+    char      text[1024];
+    int64_t   npixel;
+    int       hit, evicted, bpp, ret = -1;
+
+    if (read_full(fd, &req, sizeof(req)) < 0 || req.magic != DITHERD_MAGIC) return reply_error(fd, "bad request");
+    if (req.type == DITHERD_STATS) {
+        reply(fd, 0, 0, 0, 0, text, stats_text(&sv->stats, &sv->cache, text, sizeof(text)));
+        return 0;
+    }
+    npixel = (int64_t)req.width * req.height;
+    if (req.type != DITHERD_DITHER || npixel <= 0 || npixel > DITHERD_MAX_PIXELS || req.palsize > 256) return reply_error(fd, "bad request");
+
+    memset(&key, 0, sizeof(key));
+    key.palsize = req.palsize;
+    key.mode    = req.mode;
+    key.ordered = req.ordered;
+    key.lutbits = req.lutbits;
+    key.indexed = !!req.indexed;
+    memcpy(key.kernel, req.kernel, sizeof(key.kernel) - 1);
+    if (req.palsize > 0) {
+        if (read_full(fd, key.pal, req.palsize * 3) < 0) return -1;
+    } else {
+        memcpy(key.palid, req.palid, sizeof(key.palid) - 1);
+    }
+    bpp = key.indexed ? 1 : 3;
+    in  = malloc(npixel * 3);
+    out = malloc(npixel * bpp);
+    if (!in || !out) {
+        reply_error(fd, "out of memory");
+        goto done;
+    }
+    if (read_full(fd, in, npixel * 3) < 0) goto done;
+
+    e = cache_get(&sv->cache, &key, &hit, &evicted);
+    pthread_mutex_lock(&sv->stats.lock);
+    sv->stats.hits      += e && hit;
+    sv->stats.misses    += !hit;
+    sv->stats.evictions += evicted;
+    pthread_mutex_unlock(&sv->stats.lock);
+    if (!e) {
+        reply_error(fd, "bad palette or options");
+        goto done;
+    }
+    if (libdither_run(e->ctx, in, req.width * 3, out, req.width * bpp, req.width, req.height) < 0) {
+        reply_error(fd, "dither failed");
+        goto done;
+    }
+    ret = reply(fd, 0, req.width, req.height, bpp, out, npixel * bpp);
+
+done:
+    if (e) cache_release(&sv->cache, e);
+    free(out);
+    free(in);
+    return ret;
+}
+
+static void* worker_proc(void *arg)
+{
+    SERVER *sv = arg;
+    CONN    conn;
+    int     ret;
+    float   ms;
+
+    while (1) {
+        pthread_mutex_lock(&sv->lock);
+        while (sv->qcount == 0) pthread_cond_wait(&sv->cond, &sv->lock);
+        conn = sv->queue[sv->qhead];
+        sv->qhead = (sv->qhead + 1) % QUEUE_MAX;
+        sv->qcount--;
+        pthread_cond_broadcast(&sv->cond);
+        pthread_mutex_unlock(&sv->lock);
+        pthread_mutex_lock(&sv->stats.lock);
+        sv->stats.depth--;
+        pthread_mutex_unlock(&sv->stats.lock);
+
+        ret = serve(sv, conn.fd);
+        close(conn.fd);
+        ms  = get_time_ms() - conn.tick;
+
+        pthread_mutex_lock(&sv->stats.lock);
+        sv->stats.requests++;
+        sv->stats.errors += ret < 0;
+        sv->stats.lat[sv->stats.nlat++ % LAT_SAMPLES] = ms;
+        pthread_mutex_unlock(&sv->stats.lock);
+    }
+    return NULL;
+}
+
+static void on_signal(int sig)
+{
+    unlink(g_sockpath);
+    _exit(0);
+}
+//-- server
+
+int main(int argc, char *argv[])
+{
+    static SERVER      sv;
+    struct sockaddr_un addr = {0};
+    struct timeval     tv      = {0};
+    pthread_t          thread;
+    CONN               conn;
+    char              *paldir  = ".";
+    int                workers = WORKERS_DEF;
+    int                ncache  = CACHE_DEF;
+    int                timeout = TIMEOUT_DEF;
+    int                lfd, i;
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            snprintf(g_sockpath, sizeof(g_sockpath), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--paldir") == 0 && i + 1 < argc) {
+            paldir = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            workers = workers > 1 ? workers : 1;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            ncache = atoi(argv[++i]);
+            ncache = ncache > 1 ? ncache : 1;
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            timeout = atoi(argv[++i]);
+            timeout = timeout > 1 ? timeout : 1;
+        } else {
+            printf("usage: ditherd [--socket path] [--paldir dir] [--workers N] [--cache N] [--timeout S]\n");
+            return 0;
+        }
+    }
+
+    sv.cache.max    = ncache;
+    sv.cache.paldir = paldir;
+    pthread_mutex_init(&sv.cache.lock, NULL);
+    pthread_mutex_init(&sv.stats.lock, NULL);
+    pthread_mutex_init(&sv.lock, NULL);
+    pthread_cond_init (&sv.cond, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT , on_signal);
+    signal(SIGTERM, on_signal);
+
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, g_sockpath);
+    unlink(g_sockpath);
+    if (lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0) {
+        printf("failed to listen on %s !\n", g_sockpath);
+        return 1;
+    }
+    for (i=0; i<workers; i++) {
+        if (pthread_create(&thread, NULL, worker_proc, &sv) != 0) break;
+    }
+    if (i == 0) {
+        printf("failed to start workers !\n");
+        return 1;
+    }
+    printf("ditherd: %s, %d workers, cache %d, timeout %d s, palettes in %s\n", g_sockpath, i, ncache, timeout, paldir);
+    fflush(stdout);
+
+    tv.tv_sec = timeout;
+    while (1) {
+        conn.fd = accept(lfd, NULL, NULL);
+        if (conn.fd < 0) {
+            // out of descriptors or buffers would fail again at once, wait for
+            // connections to close instead of spinning
+            if (errno != EINTR && errno != ECONNABORTED) usleep(BACKOFF_MS * 1000);
+            continue;
+        }
+        // a client that stops sending or reading is dropped instead of holding a worker
+        setsockopt(conn.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        conn.tick = get_time_ms();
+        pthread_mutex_lock(&sv.stats.lock);
+        sv.stats.depth++;
+        sv.stats.maxdepth = sv.stats.depth > sv.stats.maxdepth ? sv.stats.depth : sv.stats.maxdepth;
+        pthread_mutex_unlock(&sv.stats.lock);
+
+        pthread_mutex_lock(&sv.lock);
+        while (sv.qcount == QUEUE_MAX) pthread_cond_wait(&sv.cond, &sv.lock);
+        sv.queue[(sv.qhead + sv.qcount++) % QUEUE_MAX] = conn;
+        pthread_cond_broadcast(&sv.cond);
+        pthread_mutex_unlock(&sv.lock);
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef __DITHERD_H__
+#define __DITHERD_H__
+
+#include <stdint.h>
+
+// dither daemon protocol over a unix domain socket, one request per connection,
+// integers in host byte order as both ends are on the same machine.
+// request : DREQ, palsize * 3 palette bytes, width * height * 3 pixel bytes, top row first.
+// response: DRESP, size bytes, the pixels (bpp bytes each), the stats text or the error text.
+#define DITHERD_MAGIC       0x52485444 // "DTHR"
+#define DITHERD_SOCKET      "/tmp/ditherd.sock"
+#define DITHERD_MAX_PIXELS  (64 * 1024 * 1024)
+
+#define DITHERD_DITHER  0
+#define DITHERD_STATS   1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;       // DITHERD_xxx
+    uint32_t width;
+    uint32_t height;
+    uint32_t mode;       // LIBDITHER_xxx
+    uint32_t ordered;    // bayer matrix size for LIBDITHER_ORDERED
+    uint32_t lutbits;    // inverse colormap bits, 0 for none
+    uint32_t indexed;    // reply one palette index per pixel
+    uint32_t palsize;    // palette entries sent with the request, 0 to use palid
+    char     palid[64];  // palette of the server, palid.pal in its palette directory
+    char     kernel[16]; // error diffusion kernel, empty for fs
+} DREQ;
+
+typedef struct {
+    uint32_t magic;
+    int32_t  status;     // 0 ok, -1 and the payload is the error text
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;        // bytes per output pixel
+    uint32_t size;       // payload bytes
+} DRESP;
+
+#endif
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+#include "libdither.h"
+#include "colormap.h"
+#include "octree.h"
+
+struct tagLIBDITHER {
+    COLORMAP map;
+    ORDERED  od;
+    int      mode;
+    int      threads;
+};
+
+void libdither_defaults(LIBDITHER_OPTS *opts)
+{
+    memset(opts, 0, sizeof(LIBDITHER_OPTS));
+    opts->mode    = LIBDITHER_DIFFUSE;
+    opts->ordered = 8;
+    opts->simd    = NEAREST_AUTO;
+    opts->threads = 1;
+}
+
+LIBDITHER* libdither_create(const uint8_t *pal, int size, const LIBDITHER_OPTS *opts)
+{
+    LIBDITHER_OPTS defs;
+    LIBDITHER     *ctx;
+    int            kernel;
+
+    if (!opts) {
+        libdither_defaults(&defs);
+        opts = &defs;
+    }
+    kernel = opts->kernel ? kernel_find(opts->kernel) : 0;
+    if (!pal || size < 1 || size > NEAREST_MAX_COLORS || kernel < 0) return NULL;
+    if (opts->mode < LIBDITHER_NONE || opts->mode > LIBDITHER_ORDERED) return NULL;
+
+    ctx = calloc(1, sizeof(LIBDITHER));
+    if (!ctx) return NULL;
+    if (colormap_init(&ctx->map, pal, size, opts->simd, opts->lutbits < LUT_MAX_BITS ? opts->lutbits : LUT_MAX_BITS, opts->exact) < 0) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->map.indexed = opts->indexed;
+    ctx->map.kernel  = kernel;
+    ctx->mode        = opts->mode;
+    ctx->threads     = opts->threads > 1 ? opts->threads : 1;
+    if (ctx->mode == LIBDITHER_ORDERED) ordered_init(&ctx->od, opts->ordered, ctx->map.pal, size);
+    return ctx;
+}
+
+void libdither_destroy(LIBDITHER *ctx)
+{
+    if (!ctx) return;
+    colormap_free(&ctx->map);
+    free(ctx);
+}
+
+// the context is never written, each call dithers with its own copy of the colormap
+int libdither_run(const LIBDITHER *ctx, const uint8_t *src, int sstride,
+                  uint8_t *dst, int dstride, int width, int height)
+{
+    COLORMAP map;
+    BMP      bsrc = { width, height, sstride, (void*)src };
+    BMP      bdst = { width, height, dstride, dst };
+
+    if (!ctx || !src || !dst || width <= 0 || height <= 0) return -1;
+    if (ctx->map.indexed && (const uint8_t*)dst == src) return -1;
+    colormap_fork(&map, &ctx->map);
+    return dither_image(&map, &ctx->od, ctx->mode, ctx->threads, &bsrc, &bdst);
+}
+
+// the octree stops merging at its first level, so below 8 colors the palette is cut
+int libdither_palette(const uint8_t *src, int stride, int width, int height, uint8_t *pal, int maxcolor)
+{
+    OCTREE  tree;
+    uint8_t buf[256 * 3];
+    int     n;
+
+    if (!src || !pal || width <= 0 || height <= 0 || maxcolor < 1 || maxcolor > 256) return -1;
+    octree_init(&tree);
+    n = -1;
+    if (octree_add_image(&tree, src, stride, width, height) == 0) {
+        octree_reduce(&tree, maxcolor);
+        if (tree.colors <= 256) {
+            octree_getpal(&tree, buf);
+            n = tree.colors < maxcolor ? tree.colors : maxcolor;
+            memcpy(pal, buf, n * 3);
+        }
+    }
+    octree_free(&tree);
+    return n;
+}
@@ -0,0 +1,60 @@
+#ifndef __LIBDITHER_H__
+#define __LIBDITHER_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// embeddable dither library, no file io and no global state. a context holds
+// a palette and its lookup structures and is read only once created, so it may
+// be used by any number of threads at the same time. all buffers belong to the
+// caller. pixels are 3 bytes, in the same channel order as the palette entries.
+#define LIBDITHER_NONE     0 // nearest color only
+#define LIBDITHER_DIFFUSE  1 // error diffusion
+#define LIBDITHER_ORDERED  2 // ordered dither with a bayer matrix
+
+// the shared library is built with hidden visibility, only these functions are exported
+#if defined(__GNUC__) && !defined(_WIN32)
+#define LIBDITHER_API  __attribute__((visibility("default")))
+#else
+#define LIBDITHER_API
+#endif
+
+typedef struct {
+    int         mode;    // LIBDITHER_xxx
+    const char *kernel;  // error diffusion kernel, fs, jarvis, stucki, sierra, burkes or atkinson, NULL for fs
+    int         ordered; // bayer matrix size for LIBDITHER_ORDERED, 2, 4, 8 or 16
+    int         lutbits; // inverse colormap bits per channel, 0 for none
+    int         exact;   // lut cells shared by several colors fall back to exact search
+    int         simd;    // highest nearest color kernel, 0 scalar, 1 sse2, 2 avx2
+    int         threads; // threads per call, the caller's included, 0 or 1 for the caller only
+    int         indexed; // output one palette index byte per pixel instead of 3 color bytes
+} LIBDITHER_OPTS;
+
+typedef struct tagLIBDITHER LIBDITHER;
+
+// sets the defaults: error diffusion with fs, no lut, best simd, one thread, color output
+LIBDITHER_API void libdither_defaults(LIBDITHER_OPTS *opts);
+
+// pal is size entries of 3 bytes, 1 to 256, opts may be NULL for the defaults.
+// returns NULL on bad arguments or out of memory.
+LIBDITHER_API LIBDITHER* libdither_create (const uint8_t *pal, int size, const LIBDITHER_OPTS *opts);
+LIBDITHER_API void       libdither_destroy(LIBDITHER *ctx);
+
+// dither width x height pixels from src to dst, strides are in bytes and may be
+// negative. dst may be src with the same stride unless the output is indexed.
+// returns 0, or -1 on bad arguments or out of memory.
+LIBDITHER_API int libdither_run(const LIBDITHER *ctx, const uint8_t *src, int sstride,
+                                uint8_t *dst, int dstride, int width, int height);
+
+// build a palette of at most maxcolor (1 to 256) entries from an image,
+// pal holds 3 * maxcolor bytes, returns the number of colors or -1.
+LIBDITHER_API int libdither_palette(const uint8_t *src, int stride, int width, int height, uint8_t *pal, int maxcolor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
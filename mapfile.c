@@ -0,0 +1,106 @@
+#define _FILE_OFFSET_BITS 64
+#include <string.h>
+#include "mapfile.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+static int mapfile_map(MAPFILE *mf, const char *file, int64_t size, int write)
+{
+    LARGE_INTEGER fsize;
+
+    memset(mf, 0, sizeof(MAPFILE));
+    mf->hfile = CreateFileA(file, write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ,
+        NULL, write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mf->hfile == INVALID_HANDLE_VALUE) {
+        mf->hfile = NULL;
+        return -1;
+    }
+    if (!write) {
+        if (!GetFileSizeEx(mf->hfile, &fsize)) goto failed;
+        size = fsize.QuadPart;
+    }
+    if (size <= 0) goto failed;
+    mf->hmap = CreateFileMappingA(mf->hfile, NULL, write ? PAGE_READWRITE : PAGE_READONLY,
+        (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (!mf->hmap) goto failed;
+    mf->data = MapViewOfFile(mf->hmap, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)size);
+    if (!mf->data) goto failed;
+    mf->size = size;
+    return 0;
+
+failed:
+    mapfile_close(mf);
+    return -1;
+}
+
+void mapfile_close(MAPFILE *mf)
+{
+    if (mf->data ) UnmapViewOfFile(mf->data);
+    if (mf->hmap ) CloseHandle(mf->hmap );
+    if (mf->hfile) CloseHandle(mf->hfile);
+    memset(mf, 0, sizeof(MAPFILE));
+}
+#else
+static int mapfile_map(MAPFILE *mf, const char *file, int64_t size, int write)
+{
+    struct stat st;
+    int         err;
+
+    memset(mf, 0, sizeof(MAPFILE));
+    mf->fd = write ? open(file, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(file, O_RDONLY);
+    if (mf->fd < 0) return -1;
+    if (write) {
+        // the blocks are reserved now, a sparse file on a full disk would fail
+        // with SIGBUS on the first store into the mapping instead of here
+        err = size > 0 ? posix_fallocate(mf->fd, 0, size) : EINVAL;
+        if (err == EINVAL || err == EOPNOTSUPP) err = ftruncate(mf->fd, size);
+        if (err != 0) goto failed;
+    } else {
+        if (fstat(mf->fd, &st) != 0) goto failed;
+        size = st.st_size;
+    }
+    if (size <= 0 || (uint64_t)size > (size_t)-1) goto failed;
+    mf->data = mmap(NULL, size, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, mf->fd, 0);
+    if (mf->data == MAP_FAILED) {
+        mf->data = NULL;
+        goto failed;
+    }
+    mf->size = size;
+    if (!write) madvise(mf->data, size, MADV_SEQUENTIAL);
+    return 0;
+
+failed:
+    close(mf->fd);
+    if (write) unlink(file); // truncated already, nothing of it is left to keep
+    memset(mf, 0, sizeof(MAPFILE));
+    return -1;
+}
+
+// a zeroed MAPFILE has fd 0 as well, the descriptor is only ours along with a mapping
+void mapfile_close(MAPFILE *mf)
+{
+    if (mf->data) {
+        munmap(mf->data, mf->size);
+        if (mf->fd >= 0) close(mf->fd);
+    }
+    memset(mf, 0, sizeof(MAPFILE));
+}
+#endif
+
+int mapfile_open(MAPFILE *mf, const char *file)
+{
+    return mapfile_map(mf, file, 0, 0);
+}
+
+int mapfile_create(MAPFILE *mf, const char *file, int64_t size)
+{
+    return mapfile_map(mf, file, size, 1);
+}
@@ -0,0 +1,23 @@
+#ifndef __MAPFILE_H__
+#define __MAPFILE_H__
+
+#include <stdint.h>
+
+// whole file memory mapping, the input is mapped read only and read in place,
+// the output is created at its final size and written straight to the page cache.
+typedef struct {
+    uint8_t *data;
+    int64_t  size;
+#ifdef _WIN32
+    void    *hfile;
+    void    *hmap;
+#else
+    int      fd;
+#endif
+} MAPFILE;
+
+int  mapfile_open  (MAPFILE *mf, const char *file);               // read only
+int  mapfile_create(MAPFILE *mf, const char *file, int64_t size); // read write, truncated to size
+void mapfile_close (MAPFILE *mf);
+
+#endif
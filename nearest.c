@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "nearest.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define NEAREST_X86
+#include <immintrin.h>
+#endif
+
+static int nearest_find_c(const NEAREST *n, int r, int g, int b)
+{
+    int mindist = INT_MAX;
+    int closest = 0;
+    int curdist, i;
+
+    for (i=0; i<n->size; i++) {
+        curdist = (r - n->r[i]) * (r - n->r[i])
+                + (g - n->g[i]) * (g - n->g[i])
+                + (b - n->b[i]) * (b - n->b[i]);
+        if (mindist > curdist) {
+            mindist = curdist;
+            closest = i;
+        }
+    }
+    return closest;
+}
+
+#ifdef NEAREST_X86
+// every lane keeps its own first minimum, pick the smallest distance, on tie the lowest index
+static int nearest_reduce(const int32_t *dist, const int32_t *idx, int num)
+{
+    int best = 0, i;
+    for (i=1; i<num; i++) {
+        if (dist[i] < dist[best] || (dist[i] == dist[best] && idx[i] < idx[best])) best = i;
+    }
+    return idx[best];
+}
+
+// squares of 8-bit differences fit in unsigned 16-bit lanes, the sum is done in 32-bit lanes
+__attribute__((target("sse2")))
+static int nearest_find_sse2(const NEAREST *n, int r, int g, int b)
+{
+    __m128i vr    = _mm_set1_epi16(r);
+    __m128i vg    = _mm_set1_epi16(g);
+    __m128i vb    = _mm_set1_epi16(b);
+    __m128i zero  = _mm_setzero_si128();
+    __m128i step  = _mm_set1_epi32(8);
+    __m128i ilo   = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i ihi   = _mm_setr_epi32(4, 5, 6, 7);
+    __m128i dlo   = _mm_set1_epi32(INT_MAX);
+    __m128i dhi   = _mm_set1_epi32(INT_MAX);
+    __m128i blo   = zero;
+    __m128i bhi   = zero;
+    __m128i dr, dg, db, d, m;
+    int32_t dist[8], idx[8];
+    int     i;
+
+    for (i=0; i<n->count; i+=8) {
+        dr = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(n->r + i)), vr);
+        dg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(n->g + i)), vg);
+        db = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(n->b + i)), vb);
+        dr = _mm_mullo_epi16(dr, dr);
+        dg = _mm_mullo_epi16(dg, dg);
+        db = _mm_mullo_epi16(db, db);
+
+        d   = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(dr, zero), _mm_unpacklo_epi16(dg, zero)), _mm_unpacklo_epi16(db, zero));
+        m   = _mm_cmplt_epi32(d, dlo);
+        dlo = _mm_or_si128(_mm_and_si128(m, d  ), _mm_andnot_si128(m, dlo));
+        blo = _mm_or_si128(_mm_and_si128(m, ilo), _mm_andnot_si128(m, blo));
+
+        d   = _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(dr, zero), _mm_unpackhi_epi16(dg, zero)), _mm_unpackhi_epi16(db, zero));
+        m   = _mm_cmplt_epi32(d, dhi);
+        dhi = _mm_or_si128(_mm_and_si128(m, d  ), _mm_andnot_si128(m, dhi));
+        bhi = _mm_or_si128(_mm_and_si128(m, ihi), _mm_andnot_si128(m, bhi));
+
+        ilo = _mm_add_epi32(ilo, step);
+        ihi = _mm_add_epi32(ihi, step);
+    }
+
+    _mm_storeu_si128((__m128i*)(dist + 0), dlo);
+    _mm_storeu_si128((__m128i*)(dist + 4), dhi);
+    _mm_storeu_si128((__m128i*)(idx  + 0), blo);
+    _mm_storeu_si128((__m128i*)(idx  + 4), bhi);
+    return nearest_reduce(dist, idx, 8);
+}
+
+// avx2 unpack works within 128-bit halves, so the lanes hold entries 0-3 & 8-11 and 4-7 & 12-15
+__attribute__((target("avx2")))
+static int nearest_find_avx2(const NEAREST *n, int r, int g, int b)
+{
+    __m256i vr    = _mm256_set1_epi16(r);
+    __m256i vg    = _mm256_set1_epi16(g);
+    __m256i vb    = _mm256_set1_epi16(b);
+    __m256i zero  = _mm256_setzero_si256();
+    __m256i step  = _mm256_set1_epi32(16);
+    __m256i ilo   = _mm256_setr_epi32(0, 1, 2, 3,  8,  9, 10, 11);
+    __m256i ihi   = _mm256_setr_epi32(4, 5, 6, 7, 12, 13, 14, 15);
+    __m256i dlo   = _mm256_set1_epi32(INT_MAX);
+    __m256i dhi   = _mm256_set1_epi32(INT_MAX);
+    __m256i blo   = zero;
+    __m256i bhi   = zero;
+    __m256i dr, dg, db, d, m;
+    int32_t dist[16], idx[16];
+    int     i;
+
+    for (i=0; i<n->count; i+=16) {
+        dr = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(n->r + i)), vr);
+        dg = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(n->g + i)), vg);
+        db = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(n->b + i)), vb);
+        dr = _mm256_mullo_epi16(dr, dr);
+        dg = _mm256_mullo_epi16(dg, dg);
+        db = _mm256_mullo_epi16(db, db);
+
+        d   = _mm256_add_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(dr, zero), _mm256_unpacklo_epi16(dg, zero)), _mm256_unpacklo_epi16(db, zero));
+        m   = _mm256_cmpgt_epi32(dlo, d);
+        dlo = _mm256_blendv_epi8(dlo, d  , m);
+        blo = _mm256_blendv_epi8(blo, ilo, m);
+
+        d   = _mm256_add_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(dr, zero), _mm256_unpackhi_epi16(dg, zero)), _mm256_unpackhi_epi16(db, zero));
+        m   = _mm256_cmpgt_epi32(dhi, d);
+        dhi = _mm256_blendv_epi8(dhi, d  , m);
+        bhi = _mm256_blendv_epi8(bhi, ihi, m);
+
+        ilo = _mm256_add_epi32(ilo, step);
+        ihi = _mm256_add_epi32(ihi, step);
+    }
+
+    _mm256_storeu_si256((__m256i*)(dist + 0), dlo);
+    _mm256_storeu_si256((__m256i*)(dist + 8), dhi);
+    _mm256_storeu_si256((__m256i*)(idx  + 0), blo);
+    _mm256_storeu_si256((__m256i*)(idx  + 8), bhi);
+    return nearest_reduce(dist, idx, 16);
+}
+#endif
+
+// pick the best kernel up to maxlevel the cpu supports
+static void nearest_select(NEAREST *n, int maxlevel)
+{
+    n->level = NEAREST_SCALAR;
+    n->find  = nearest_find_c;
+#ifdef NEAREST_X86
+    __builtin_cpu_init();
+    if (maxlevel >= NEAREST_SSE2 && __builtin_cpu_supports("sse2")) {
+        n->level = NEAREST_SSE2;
+        n->find  = nearest_find_sse2;
+    }
+    if (maxlevel >= NEAREST_AVX2 && __builtin_cpu_supports("avx2")) {
+        n->level = NEAREST_AVX2;
+        n->find  = nearest_find_avx2;
+    }
+#endif
+}
+
+void nearest_init(NEAREST *n, const uint8_t *pal, int size, int maxlevel)
+{
+    int i, j;
+
+    size     = size < NEAREST_MAX_COLORS ? size : NEAREST_MAX_COLORS;
+    n->size  = size;
+    n->count = NEAREST_SOA_COUNT(size);
+    for (i=0; i<n->count; i++) {
+        // padding entries repeat entry 0 with a higher index, so they never win
+        j = i < size ? i : 0;
+        n->r[i] = size ? pal[j * 3 + 0] : 0;
+        n->g[i] = size ? pal[j * 3 + 1] : 0;
+        n->b[i] = size ? pal[j * 3 + 2] : 0;
+    }
+    nearest_select(n, maxlevel);
+}
+
+void nearest_init_soa(NEAREST *n, const int16_t *soa, int size, int maxlevel)
+{
+    size     = size < NEAREST_MAX_COLORS ? size : NEAREST_MAX_COLORS;
+    n->size  = size;
+    n->count = NEAREST_SOA_COUNT(size);
+    memcpy(n->r, soa + n->count * 0, n->count * sizeof(int16_t));
+    memcpy(n->g, soa + n->count * 1, n->count * sizeof(int16_t));
+    memcpy(n->b, soa + n->count * 2, n->count * sizeof(int16_t));
+    nearest_select(n, maxlevel);
+}
+
+const char* nearest_name(const NEAREST *n)
+{
+    static const char *names[] = { "scalar", "sse2", "avx2" };
+    return names[n->level];
+}
+
+//++ kdtree
+// sort the indices by the given axis, ties by index, palettes are small so insertion sort will do
+static void kdtree_sort(const uint8_t *pal, uint16_t *idx, int n, int axis)
+{
+    uint16_t t;
+    int      i, j;
+    for (i=1; i<n; i++) {
+        t = idx[i];
+        for (j=i; j>0 && (pal[idx[j-1]*3+axis] > pal[t*3+axis] || (pal[idx[j-1]*3+axis] == pal[t*3+axis] && idx[j-1] > t)); j--) {
+            idx[j] = idx[j-1];
+        }
+        idx[j] = t;
+    }
+}
+
+static int kdtree_build(KDTREE *tree, const uint8_t *pal, uint16_t *idx, int n)
+{
+    KDNODE *node;
+    int     lo[3] = { 255, 255, 255 }, hi[3] = { 0 };
+    int     axis, m, i, k;
+
+    if (n <= 0) return -1;
+
+    // split on the axis with the largest extent, at the median
+    for (i=0; i<n; i++) {
+        for (k=0; k<3; k++) {
+            lo[k] = lo[k] < pal[idx[i]*3+k] ? lo[k] : pal[idx[i]*3+k];
+            hi[k] = hi[k] > pal[idx[i]*3+k] ? hi[k] : pal[idx[i]*3+k];
+        }
+    }
+    axis = 0;
+    if (hi[1] - lo[1] > hi[axis] - lo[axis]) axis = 1;
+    if (hi[2] - lo[2] > hi[axis] - lo[axis]) axis = 2;
+    kdtree_sort(pal, idx, n, axis);
+    m = n / 2;
+
+    node = &tree->nodes[tree->size++];
+    node->c[0]  = pal[idx[m]*3+0];
+    node->c[1]  = pal[idx[m]*3+1];
+    node->c[2]  = pal[idx[m]*3+2];
+    node->axis  = axis;
+    node->index = idx[m];
+    node->child[0] = kdtree_build(tree, pal, idx, m);
+    node->child[1] = kdtree_build(tree, pal, idx + m + 1, n - m - 1);
+    for (node->minidx=idx[0],i=1; i<n; i++) {
+        node->minidx = node->minidx < idx[i] ? node->minidx : idx[i];
+    }
+    return node - tree->nodes;
+}
+
+KDTREE* kdtree_create(const uint8_t *pal, int size)
+{
+    uint16_t idx[NEAREST_MAX_COLORS];
+    KDTREE  *tree;
+    int      i;
+
+    size = size < NEAREST_MAX_COLORS ? size : NEAREST_MAX_COLORS;
+    tree = malloc(sizeof(KDTREE) + size * sizeof(KDNODE));
+    if (!tree) return NULL;
+    for (i=0; i<size; i++) idx[i] = i;
+    tree->size = 0;
+    tree->root = kdtree_build(tree, pal, idx, size);
+    return tree;
+}
+
+void kdtree_destroy(KDTREE *tree)
+{
+    free(tree);
+}
+
+// depth first without recursion, the far side of each split is pushed with the squared
+// distance to its plane. a node is skipped when that is farther than the best so far,
+// or as far and its subtree cannot hold a lower index.
+int kdtree_find(const KDTREE *tree, int r, int g, int b, int *visits)
+{
+    const KDNODE *n;
+    int           q[3]  = { r, g, b };
+    int           stack[NEAREST_MAX_COLORS][2];
+    int           sp    = 0;
+    int           bestd = INT_MAX;
+    int           besti = 0;
+    int           node  = tree->root;
+    int           plane = 0;
+    int           nodes = 0;
+    int           d, dist, side;
+
+    for (;;) {
+        if (node >= 0 && (plane < bestd || (plane == bestd && tree->nodes[node].minidx < besti))) {
+            n    = &tree->nodes[node];
+            nodes++;
+            dist = (q[0] - n->c[0]) * (q[0] - n->c[0])
+                 + (q[1] - n->c[1]) * (q[1] - n->c[1])
+                 + (q[2] - n->c[2]) * (q[2] - n->c[2]);
+            if (dist < bestd || (dist == bestd && n->index < besti)) {
+                bestd = dist;
+                besti = n->index;
+            }
+            d    = q[n->axis] - n->c[n->axis];
+            side = d < 0 ? 0 : 1;
+            if (n->child[!side] >= 0) {
+                stack[sp][0] = n->child[!side];
+                stack[sp][1] = d * d;
+                sp++;
+            }
+            node = n->child[side]; // the near side shares the bound of its parent
+            continue;
+        }
+        if (sp == 0) break;
+        sp--;
+        node  = stack[sp][0];
+        plane = stack[sp][1];
+    }
+    if (visits) *visits = nodes;
+    return besti;
+}
+//-- kdtree
+
+//++ lut
+// check if palette color c is the closest one for every point of the cell [lo, hi]
+static int lut_cell_exact(NEAREST *n, int c, int lo[3], int hi[3])
+{
+    int16_t *pc[3] = { n->r, n->g, n->b };
+    int      f, d, i, k;
+
+    for (i=0; i<n->size; i++) {
+        if (i == c) continue;
+        // dist(q, c) - dist(q, i) is linear in q, so its max over the cell is at a corner
+        for (f=0,k=0; k<3; k++) {
+            d  = pc[k][c] - pc[k][i];
+            f += pc[k][c] * pc[k][c] - pc[k][i] * pc[k][i] - 2 * d * (d > 0 ? lo[k] : hi[k]);
+        }
+        // on tie nearest_find picks the lower index
+        if (f > 0 || (f == 0 && i < c)) return 0;
+    }
+    return 1;
+}
+
+int lut_create(LUT *lut, NEAREST *near, int bits, int exact)
+{
+    int       shift = 8 - bits;
+    int       n     = 1 << bits;
+    int       lo[3], hi[3];
+    int       r, g, b, c;
+    uint16_t *p;
+
+    lut->table = malloc(sizeof(uint16_t) << (bits * 3));
+    if (!lut->table) return -1;
+    lut->bits = bits;
+    lut->nref = 0;
+    lut->near = near;
+
+    p = lut->table;
+    for (r=0; r<n; r++) {
+        lo[0] = r << shift; hi[0] = lo[0] + (1 << shift) - 1;
+        for (g=0; g<n; g++) {
+            lo[1] = g << shift; hi[1] = lo[1] + (1 << shift) - 1;
+            for (b=0; b<n; b++) {
+                lo[2] = b << shift; hi[2] = lo[2] + (1 << shift) - 1;
+                c = nearest_find(near, (lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2, (lo[2] + hi[2]) / 2);
+                if (exact && !lut_cell_exact(near, c, lo, hi)) {
+                    c |= LUT_REFINE;
+                    lut->nref++;
+                }
+                *p++ = c;
+            }
+        }
+    }
+    return 0;
+}
+
+void lut_destroy(LUT *lut)
+{
+    free(lut->table);
+    lut->table = NULL;
+}
+//-- lut
@@ -0,0 +1,92 @@
+#ifndef __NEAREST_H__
+#define __NEAREST_H__
+
+#include <stdint.h>
+
+// nearest palette color search, the palette is kept as structure of arrays
+// so the distances to 8 (sse2) or 16 (avx2) entries are computed at once.
+// all kernels return the lowest index on tie, the same as a linear scan.
+#define NEAREST_MAX_COLORS  256
+#define NEAREST_ALIGN       16
+
+#define NEAREST_SCALAR      0
+#define NEAREST_SSE2        1
+#define NEAREST_AVX2        2
+#define NEAREST_AUTO        NEAREST_AVX2
+
+// entries of each soa array, the palette size rounded up to NEAREST_ALIGN
+#define NEAREST_SOA_COUNT(size)  (((size) + NEAREST_ALIGN - 1) & ~(NEAREST_ALIGN - 1))
+
+typedef struct tagNEAREST {
+    int      size;  // palette size
+    int      count; // size rounded up to NEAREST_ALIGN, padded with copies of entry 0
+    int      level; // kernel in use
+    int16_t  r[NEAREST_MAX_COLORS + NEAREST_ALIGN];
+    int16_t  g[NEAREST_MAX_COLORS + NEAREST_ALIGN];
+    int16_t  b[NEAREST_MAX_COLORS + NEAREST_ALIGN];
+    int    (*find)(const struct tagNEAREST *n, int r, int g, int b);
+} NEAREST;
+
+// pal is r, g, b triplets, maxlevel limits the kernel picked from what the cpu supports
+void nearest_init(NEAREST *n, const uint8_t *pal, int size, int maxlevel);
+// same from a saved soa layout, the r, g and b arrays of NEAREST_SOA_COUNT(size) entries back to back
+void nearest_init_soa(NEAREST *n, const int16_t *soa, int size, int maxlevel);
+const char* nearest_name(const NEAREST *n);
+
+static inline int nearest_find(const NEAREST *n, int r, int g, int b)
+{
+    return n->find(n, r, g, b);
+}
+
+// exact nearest color k-d tree, the nodes live in one block right after the
+// header and link each other by index, kdtree_destroy is a single free().
+// it beats the simd scan on large palettes, KDTREE_MIN_COLORS is the break even.
+#define KDTREE_MIN_COLORS  128
+
+typedef struct {
+    uint8_t  c[3];     // color of this node
+    uint8_t  axis;     // split axis
+    uint16_t index;    // palette index
+    uint16_t minidx;   // lowest palette index in this subtree
+    int16_t  child[2]; // lower & upper side, -1 if none
+} KDNODE;
+
+typedef struct {
+    int     size;
+    int     root;
+    KDNODE  nodes[];
+} KDTREE;
+
+KDTREE* kdtree_create (const uint8_t *pal, int size);
+void    kdtree_destroy(KDTREE *tree);
+int     kdtree_find   (const KDTREE *tree, int r, int g, int b, int *visits); // visits may be NULL
+
+// inverse colormap, quantized rgb -> palette index, built once per palette.
+// with exact set the cells not owned by a single color are marked LUT_REFINE
+// and fall back to nearest_find, so the result equals the nearest color search.
+#define LUT_MAX_BITS  8
+#define LUT_REFINE    0x8000  // the cell is not owned by a single color, do exact search
+
+typedef struct {
+    int       bits;   // index bits per channel
+    int       nref;   // number of cells marked LUT_REFINE
+    NEAREST  *near;
+    uint16_t *table;
+} LUT;
+
+int  lut_create (LUT *lut, NEAREST *near, int bits, int exact);
+void lut_destroy(LUT *lut);
+
+static inline int lut_cell(const LUT *lut, int r, int g, int b)
+{
+    int shift = 8 - lut->bits;
+    return lut->table[((r >> shift) << (lut->bits * 2)) | ((g >> shift) << lut->bits) | (b >> shift)];
+}
+
+static inline int lut_find_color(const LUT *lut, int r, int g, int b)
+{
+    int c = lut_cell(lut, r, g, b);
+    return (c & LUT_REFINE) ? nearest_find(lut->near, r, g, b) : c;
+}
+
+#endif
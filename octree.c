@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+#include "octree.h"
+
+//++ for octree
+#define OCTREE_BLOCK_SIZE  (1 << OCTREE_BLOCK_BITS)
+
+static inline OCTNODE* octree_node(OCTREE *tree, uint32_t i)
+{
+    return &tree->blocks[i >> OCTREE_BLOCK_BITS][i & (OCTREE_BLOCK_SIZE - 1)];
+}
+
+// next zeroed node of the arena, -1 if out of memory
+static int octree_alloc(OCTREE *tree)
+{
+    OCTNODE **blocks;
+    if (tree->used == tree->nblock * OCTREE_BLOCK_SIZE) {
+        if (tree->nblock == tree->maxblock) {
+            tree->maxblock = tree->maxblock ? tree->maxblock * 2 : 64;
+            blocks = realloc(tree->blocks, tree->maxblock * sizeof(OCTNODE*));
+            if (!blocks) return -1;
+            tree->blocks = blocks;
+        }
+        tree->blocks[tree->nblock] = calloc(OCTREE_BLOCK_SIZE, sizeof(OCTNODE));
+        if (!tree->blocks[tree->nblock]) return -1;
+        tree->nblock++;
+    }
+    return tree->used++;
+}
+
+void octree_init(OCTREE *tree)
+{
+    memset(tree, 0, sizeof(OCTREE));
+}
+
+void octree_free(OCTREE *tree)
+{
+    int i;
+    for (i=0; i<tree->nblock; i++) free(tree->blocks[i]);
+    free(tree->blocks);
+    memset(tree, 0, sizeof(OCTREE));
+}
+
+// add count pixels of the cell of color r, g, b, whose channels sum to sum
+static inline int octree_add(OCTREE *tree, int r, int g, int b, uint64_t count, const uint64_t sum[3])
+{
+    OCTNODE *node, *child;
+    int      idx, c, i;
+
+    // the root
+    if (tree->used == 0) {
+        if (octree_alloc(tree) < 0) return -1;
+        tree->count[0] = 1;
+    }
+    node = octree_node(tree, 0);
+    node->pcnt += count; // increase pcnt for root node
+
+    for (i=1; i<=OCTREE_MAX_DEPTH; i++) {
+        idx = ((r >> (6 - i)) & (1 << 2))
+            | ((g >> (7 - i)) & (1 << 1))
+            | ((b >> (8 - i)) & (1 << 0));
+        c = node->child[idx];
+        if (!c) {
+            // allocate node, blocks never move so node stays valid
+            if ((c = octree_alloc(tree)) < 0) return -1;
+            node->child[idx] = c;
+            tree->nodes++;
+
+            // link node at the head of its level
+            child = octree_node(tree, c);
+            child->next   = tree->head[i];
+            tree->head[i] = c;
+            tree->count[i]++;
+
+            if (i == OCTREE_MAX_DEPTH) {
+                child->leaf = 1; // it is a leaf
+                tree->colors++;  // update total number of colors
+            }
+        }
+        node = octree_node(tree, c); // child
+        node->pcnt += count; // increase pcnt for child
+    }
+
+    // update the channel sums of the leaf
+    node->sum[0] += sum[0];
+    node->sum[1] += sum[1];
+    node->sum[2] += sum[2];
+    return 0;
+}
+
+int octree_add_color(OCTREE *tree, int r, int g, int b)
+{
+    uint64_t sum[3] = { r, g, b };
+    return octree_add(tree, r, g, b, 1, sum);
+}
+
+int octree_add_image(OCTREE *tree, const uint8_t *data, int stride, int width, int height)
+{
+    const uint8_t *p;
+    int            x, y;
+    for (y=0; y<height; y++, data+=stride) {
+        for (p=data,x=0; x<width; x++, p+=3) {
+            if (octree_add_color(tree, p[0], p[1], p[2]) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// the cells in key order, each down the path of its mean color
+int octree_add_hist(OCTREE *tree, HIST *hist)
+{
+    HISTENTRY *e;
+    int        n, i;
+    n = hist_sort(hist);
+    for (i=0; i<n; i++) {
+        e = &hist->table[i];
+        if (octree_add(tree, e->sum[0] / e->count, e->sum[1] / e->count, e->sum[2] / e->count, e->count, e->sum) < 0) return -1;
+    }
+    return 0;
+}
+
+// min heap of the nodes of a level by pixel count, on tie the lower path first.
+// the path is the child indices from the root, so the order does not depend on
+// the order the nodes were added in, pixel by pixel or from a histogram.
+typedef struct {
+    uint64_t pcnt;
+    uint32_t path;
+    uint32_t idx;
+} HEAPITEM;
+
+static inline int heap_less(const HEAPITEM *a, const HEAPITEM *b)
+{
+    return a->pcnt < b->pcnt || (a->pcnt == b->pcnt && a->path < b->path);
+}
+
+static void heap_down(HEAPITEM *heap, int n, int i)
+{
+    HEAPITEM item = heap[i];
+    int      c;
+    while ((c = i * 2 + 1) < n) {
+        if (c + 1 < n && heap_less(&heap[c + 1], &heap[c])) c++;
+        if (!heap_less(&heap[c], &item)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = item;
+}
+
+// the nodes of level i under node c, of level depth, in path order
+static int octree_collect(OCTREE *tree, uint32_t c, int depth, uint32_t path, int i, HEAPITEM *heap, int n)
+{
+    OCTNODE *node = octree_node(tree, c);
+    int      k;
+    if (depth == i) {
+        heap[n].pcnt = node->pcnt;
+        heap[n].path = path;
+        heap[n].idx  = c;
+        return n + 1;
+    }
+    for (k=0; k<8; k++) {
+        if (node->child[k]) n = octree_collect(tree, node->child[k], depth + 1, path * 8 + k, i, heap, n);
+    }
+    return n;
+}
+
+// merge the children of node, a node of level i, into it
+static void octree_fold(OCTREE *tree, OCTNODE *node, int i)
+{
+    OCTNODE *child;
+    uint64_t sum[3] = {0};
+    int      k;
+
+    for (k=0; k<8; k++) {
+        if (!node->child[k]) continue;
+        child = octree_node(tree, node->child[k]);
+        sum[0] += child->sum[0];
+        sum[1] += child->sum[1];
+        sum[2] += child->sum[2];
+        child->dead = 1;          // merged, skipped from now on
+        tree->count[i+1]--;       // update child level node count
+        tree->colors--;           // update number of total colors
+    }
+
+    // the children are gone, the sums take their place
+    node->sum[0] = sum[0];
+    node->sum[1] = sum[1];
+    node->sum[2] = sum[2];
+    node->leaf   = 1; // it is a leaf
+    tree->colors++;   // update number of total colors
+}
+
+// the deepest level is folded first, least used node first, as before. when a
+// level is reached its children are the only leaves, so folding it whole leaves
+// count[i] colors: while that is still at least maxcolor every node is folded,
+// in any order as the result is the same, and only the last level, the one that
+// is folded in part, needs the heap. it has fewer than maxcolor nodes.
+int octree_reduce(OCTREE *tree, int maxcolor)
+{
+    HEAPITEM *heap;
+    OCTNODE  *node;
+    uint32_t  c;
+    int       n, i, j;
+
+    if (tree->colors <= maxcolor) return 0;
+    for (i=OCTREE_MAX_DEPTH-1; i>=1 && tree->colors>maxcolor && tree->count[i]>=maxcolor; i--) {
+        for (c=tree->head[i]; c; c=node->next) {
+            node = octree_node(tree, c);
+            octree_fold(tree, node, i);
+        }
+    }
+    if (tree->colors <= maxcolor || i < 1) return tree->colors <= maxcolor ? 0 : -1;
+
+    heap = malloc(tree->count[i] * sizeof(HEAPITEM));
+    if (!heap) return -1;
+    n = octree_collect(tree, 0, 0, 0, i, heap, 0);
+    for (j=n/2-1; j>=0; j--) heap_down(heap, n, j);
+
+    while (n > 0 && tree->colors > maxcolor) {
+        node    = octree_node(tree, heap[0].idx);
+        heap[0] = heap[--n];
+        heap_down(heap, n, 0);
+        octree_fold(tree, node, i);
+    }
+    free(heap);
+    return tree->colors <= maxcolor ? 0 : -1;
+}
+
+// the leaves under node c in path order, a folded node is a leaf and its
+// children are not visited, the union holds its sums now
+static uint8_t* octree_leaves(OCTREE *tree, uint32_t c, uint8_t *pal)
+{
+    OCTNODE *node = octree_node(tree, c);
+    int      k;
+    if (node->leaf) {
+        *pal++ = node->sum[0] / node->pcnt;
+        *pal++ = node->sum[1] / node->pcnt;
+        *pal++ = node->sum[2] / node->pcnt;
+        return pal;
+    }
+    for (k=0; k<8; k++) {
+        if (node->child[k]) pal = octree_leaves(tree, node->child[k], pal);
+    }
+    return pal;
+}
+
+void octree_getpal(OCTREE *tree, uint8_t *pal)
+{
+    if (tree->used > 0) octree_leaves(tree, 0, pal);
+}
+//-- for octree
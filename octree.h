@@ -0,0 +1,51 @@
+#ifndef __OCTREE_H__
+#define __OCTREE_H__
+
+#include <stdint.h>
+#include "colorhist.h"
+
+// octree color quantizer, every pixel is added down to a leaf of depth 8,
+// then the least used nodes are merged bottom up until maxcolor leaves remain,
+// the palette is the average color of each leaf, the leaves in tree order.
+// nodes come from an arena of fixed size blocks that are never moved, they
+// refer to each other by arena index, the root is index 0. a node is inner
+// or leaf, never both, so the children and the channel sums share memory.
+typedef struct {
+    union {
+        uint32_t child[8]; // inner node, arena index of each child, 0 for none
+        uint64_t sum[3];   // leaf, r, g and b sums of its pixels
+    };
+    uint64_t pcnt;  // pixels under this node, images may pass 4G pixels
+    uint32_t next;  // next node of the same level, 0 for the end
+    uint8_t  leaf;
+    uint8_t  dead;  // merged into its parent by octree_reduce
+} OCTNODE;
+
+#define OCTREE_MAX_DEPTH   8
+#define OCTREE_BLOCK_BITS  12 // 4096 nodes per arena block
+
+typedef struct {
+    OCTNODE **blocks;
+    int       nblock;
+    int       maxblock;
+    int       used;  // arena nodes in use, the root included
+    uint32_t  head [OCTREE_MAX_DEPTH + 1]; // first node of each level
+    int       count[OCTREE_MAX_DEPTH + 1]; // nodes of each level, merged ones excluded
+    int       colors;
+    int       nodes; // total nodes ever allocated, the root excluded
+} OCTREE;
+
+void octree_init     (OCTREE *tree);
+void octree_free     (OCTREE *tree);
+int  octree_add_color(OCTREE *tree, int r, int g, int b); // -1 if out of memory
+int  octree_add_image(OCTREE *tree, const uint8_t *data, int stride, int width, int height);
+// adds the distinct colors of a histogram with their counts instead of every pixel,
+// the histogram is sorted first (see hist_sort) so the result does not depend on
+// how it was filled. with 8 bits per channel the leaves get the same counts and sums
+// as with octree_add_image, only the order of the nodes in the arena differs, which
+// neither the reduce nor the palette depend on, so the palette is the same.
+int  octree_add_hist (OCTREE *tree, HIST *hist);
+int  octree_reduce   (OCTREE *tree, int maxcolor);
+void octree_getpal   (OCTREE *tree, uint8_t *pal);
+
+#endif
@@ -1,11 +1,20 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-
-// Ͷ
-typedef unsigned char  uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned int   uint32_t;
+#include <time.h>
+#include "mapfile.h"
+#include "octree.h"
+#include "colorhist.h"
+#include "wu.h"
+#include "nearest.h"
+#include "cpal.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 /* ڲʵ */
 static int ALIGN(int x, int y) {
@@ -13,6 +22,31 @@ static int ALIGN(int x, int y) {
     return (x + y - 1) & ~(y - 1);
 }
 
+static double get_time_ms(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, tick;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&tick);
+    return (double)tick.QuadPart * 1000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+// peak resident memory of the process in KB
+static long get_peak_mem_kb(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc = { sizeof(pmc) };
+    return K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? (long)(pmc.PeakWorkingSetSize / 1024) : 0;
+#else
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+#endif
+}
 
 //++ for bmp file ++//
 // ڲͶ
@@ -74,6 +108,35 @@ static int bmp_load(BMP *pb, char *file)
     return pb->pdata ? 0 : -1;
 }
 
+// map a 24bit bmp read only, pdata points at the top row inside the mapping and
+// the stride is negative for the usual bottom-up file, no pixel is copied
+static int bmp_map(BMP *pb, MAPFILE *mf, char *file)
+{
+    BMPFILEHEADER header;
+    int64_t       size;
+
+    if (mapfile_open(mf, file) < 0) return -1;
+    if (mf->size < (int64_t)sizeof(header)) goto failed;
+    memcpy(&header, mf->data, sizeof(header));
+    if (header.biBitCount != 24 || header.biCompression != 0 || (int32_t)header.biWidth <= 0 || header.biHeight == 0) goto failed;
+    pb->width  = header.biWidth;
+    pb->height = abs((int32_t)header.biHeight);
+    pb->stride = ALIGN(pb->width * 3, 4);
+    size = (int64_t)pb->stride * pb->height;
+    if (header.bfOffBits + size > mf->size) goto failed;
+    if ((int32_t)header.biHeight < 0) { // top-down
+        pb->pdata  = mf->data + header.bfOffBits;
+    } else {
+        pb->pdata  = mf->data + header.bfOffBits + size - pb->stride;
+        pb->stride = -pb->stride;
+    }
+    return 0;
+
+failed:
+    mapfile_close(mf);
+    return -1;
+}
+
 static void bmp_free(BMP *pb)
 {
     if (pb->pdata) {
@@ -84,18 +147,6 @@ static void bmp_free(BMP *pb)
     pb->height = 0;
     pb->stride = 0;
 }
-
-static void bmp_getpixel(BMP *pb, int x, int y, int *r, int *g, int *b)
-{
-    uint8_t *pbyte = pb->pdata;
-    if (x >= pb->width || y >= pb->height) {
-        *r = *g = *b = 0;
-        return;
-    }
-    *r = pbyte[x * 3 + 0 + y * pb->stride];
-    *g = pbyte[x * 3 + 1 + y * pb->stride];
-    *b = pbyte[x * 3 + 2 + y * pb->stride];
-}
 //++ for bmp file ++//
 
 
@@ -129,216 +180,181 @@ static void create_pal_color(uint8_t *pal, int nbits)
         }
     }
 }
-//-- for create palette
-
-
-//++ for octree
-typedef struct tagNODE {
-    uint32_t        leaf;
-    uint32_t        pcnt;
-    struct tagNODE *prev;
-    struct tagNODE *next;
-    struct tagNODE *child[8];
-} NODE;
-
-#define OCTREE_MAX_DEPTH           8
-#define NODE_GET_RSUM(node)        ((uint32_t)((node)->child[1]))
-#define NODE_GET_GSUM(node)        ((uint32_t)((node)->child[2]))
-#define NODE_GET_BSUM(node)        ((uint32_t)((node)->child[3]))
-#define NODE_SET_RSUM(node, rsum)  do { (node)->child[1] = (NODE*)(rsum); } while (0)
-#define NODE_SET_GSUM(node, gsum)  do { (node)->child[2] = (NODE*)(gsum); } while (0)
-#define NODE_SET_BSUM(node, bsum)  do { (node)->child[3] = (NODE*)(bsum); } while (0)
-
-typedef struct {
-    NODE  levels[OCTREE_MAX_DEPTH + 1];
-    int   colors;
-} OCTREE;
-
-static int compare_node(const void *arg1, const void *arg2)
-{
-    NODE *node1 = *(NODE**)arg1;
-    NODE *node2 = *(NODE**)arg2;
-    return node1->pcnt - node2->pcnt;
-}
 
-static void octree_init(OCTREE *tree)
+// read a text palette, one "r g b" line per color
+static int load_pal_text(uint8_t *pal, char *file)
 {
-    memset(tree, 0, sizeof(OCTREE));
-}
-
-static void octree_free(OCTREE *tree)
-{
-    NODE *head;
-    NODE *node;
-    int   i;
-    for (i=1; i<=OCTREE_MAX_DEPTH; i++) {
-        head = tree->levels[i].next;
-        while (head) {
-            node = head;
-            head = head->next;
-            free(node);
-        }
+    FILE *fp = fopen(file, "rb");
+    int   r, g, b, n = 0;
+    if (!fp) return 0;
+    while (n < 256 && fscanf(fp, "%d %d %d", &r, &g, &b) == 3) {
+        pal[n * 3 + 0] = r;
+        pal[n * 3 + 1] = g;
+        pal[n * 3 + 2] = b;
+        n++;
     }
+    fclose(fp);
+    return n;
 }
+//-- for create palette
 
-static void octree_add_color(OCTREE *tree, int r, int g, int b)
-{
-    NODE *node = &tree->levels[0];
-    int   idx, i;
-
-    node->pcnt++; // increase pcnt for root node
-
-    for (i=1; i<=OCTREE_MAX_DEPTH; i++) {
-        idx = ((r >> (6 - i)) & (1 << 2))
-            | ((g >> (7 - i)) & (1 << 1))
-            | ((b >> (8 - i)) & (1 << 0));
-        if (!node->child[idx]) {
-            // allocate node
-            node->child[idx] = calloc(1, sizeof(NODE));
-
-            //++ link node
-            node->child[idx]->next = tree->levels[i].next;
-            node->child[idx]->prev =&tree->levels[i];
-            if (tree->levels[i].next) {
-                tree->levels[i].next->prev = node->child[idx];
-            }
-            tree->levels[i].next = node->child[idx];
-            //-- link node
-
-            // update pcnt which means total node number of this level
-            tree->levels[i].pcnt += 1;
-
-            if (i == OCTREE_MAX_DEPTH) {
-                node->child[idx]->leaf = 1; // it is a leaf
-                tree->colors++; // update total number of colors
-            }
-        }
-        node = node->child[idx]; // child
-        node->pcnt++; // increase pcnt for child
-    }
-
-    // update rsum & gsum & bsum for leaf node
-    NODE_SET_RSUM(node, NODE_GET_RSUM(node) + r);
-    NODE_SET_GSUM(node, NODE_GET_GSUM(node) + g);
-    NODE_SET_BSUM(node, NODE_GET_BSUM(node) + b);
-}
 
-static int octree_reduce(OCTREE *tree, int maxcolor)
+typedef struct {
+    int     histbits; // > 0 counts the colors first, at histbits per channel, and feeds
+                      // the octree once per distinct color instead of once per pixel
+    int     nthread;  // threads counting bands of rows, the palette is the same for any
+    int64_t sample;   // > 0 counts only this many pixels, a stratified pseudo-random sample
+    int     mse;      // print the error of the palette against every pixel
+    int     wu;       // wu's quantizer instead of the octree
+    int     stats;
+} PALOPTS;
+
+// mean squared error per channel of every pixel against its nearest palette
+// color, the pixels are counted first so each distinct color is searched once
+static double palette_mse(const uint8_t *pal, int size, BMP *pb, int nthread)
 {
-    NODE **list = NULL;
-    NODE  *node = NULL;
-    int    ret  = -1;
-    int    rsum, gsum, bsum;
-    int    num_node;
-    int    i, j, k;
-
-    for (i=OCTREE_MAX_DEPTH-1; i>=1; i--) {
-        // allocate a list for qsort
-        num_node = tree->levels[i].pcnt;
-        if (num_node == 0) continue;
-        list = malloc(num_node * sizeof(NODE*));
-        if (!list) break;
-
-        // copy node to list
-        j    = 0;
-        node = tree->levels[i].next;
-        while (node) {
-            list[j++] = node;
-            node = node->next;
-        }
-
-        // qsort list
-        qsort(list, num_node, sizeof(NODE*), compare_node);
-
-        // traverse level link list and do reduce
-        for (j=0; j<num_node; j++) {
-           if (tree->colors <= maxcolor) {
-                ret = 0;
-                goto done;
-            }
-
-            rsum = gsum = bsum = 0; // init rsum, gsum & bsum
-            for (k=0; k<8; k++) {
-                NODE *child = list[j]->child[k];
-                if (!child) continue;
-                // reduce rsum, gsum & bsum
-                rsum += NODE_GET_RSUM(child);
-                gsum += NODE_GET_GSUM(child);
-                bsum += NODE_GET_BSUM(child);
-
-                // remove child from level link list
-                if (child->prev) child->prev->next = child->next;
-                if (child->next) child->next->prev = child->prev;
-
-                free(child); // free memory
-                list[j]->child[k] = NULL; // set to NULL
-                tree->levels[i+1].pcnt--; // update child level node count
-                tree->colors--;           // update number of total colors
-            }
-
-            // set reduced rsum, gsum & bsum
-            NODE_SET_RSUM(list[j], rsum);
-            NODE_SET_GSUM(list[j], gsum);
-            NODE_SET_BSUM(list[j], bsum);
-            list[j]->leaf = 1; // it is a leaf
-            tree->colors++;    // update number of total colors
-        }
-
-        // free list
-        free(list);
+    NEAREST    near;
+    HIST       hist;
+    HISTENTRY *e;
+    uint64_t   sum = 0;
+    int        i, c, d, dist, r, g, b;
+
+    if (hist_init(&hist, 8) < 0) return -1;
+    if (hist_add_image_threads(&hist, pb->pdata, pb->stride, pb->width, pb->height, nthread) < 0) {
+        hist_free(&hist);
+        return -1;
     }
-
-done:
-    return ret;
-}
-
-static void octree_getpal(OCTREE *tree, uint8_t *pal)
-{
-    NODE *node;
-    int   i;
-    for (i=OCTREE_MAX_DEPTH; i>=1; i--) {
-        node = tree->levels[i].next;
-        while (node) {
-            if (node->leaf) {
-                *pal++ = NODE_GET_RSUM(node) / node->pcnt;
-                *pal++ = NODE_GET_GSUM(node) / node->pcnt;
-                *pal++ = NODE_GET_BSUM(node) / node->pcnt;
-            }
-            node = node->next;
-        }
+    nearest_init(&near, pal, size, NEAREST_AUTO);
+    for (i=0; i<=hist.mask; i++) {
+        e = &hist.table[i];
+        if (e->key == HIST_EMPTY) continue;
+        r    = (e->key >> 16) & 0xFF;
+        g    = (e->key >>  8) & 0xFF;
+        b    = (e->key >>  0) & 0xFF;
+        c    = nearest_find(&near, r, g, b);
+        d    = r - pal[c * 3 + 0]; dist  = d * d;
+        d    = g - pal[c * 3 + 1]; dist += d * d;
+        d    = b - pal[c * 3 + 2]; dist += d * d;
+        sum += (uint64_t)dist * e->count;
     }
+    hist_free(&hist);
+    return pb->width > 0 && pb->height > 0 ? (double)sum / ((int64_t)pb->width * pb->height * 3) : 0;
 }
-//-- for octree
-
-
 
-static void build_best_match_pal(uint8_t *pal, int maxcolor, char *file)
+static void build_best_match_pal(uint8_t *pal, int maxcolor, char *file, PALOPTS *opts)
 {
     BMP      bmp  = {};
+    MAPFILE  mf   = {};
     OCTREE   tree = {};
-    int      r, g, b;
-    int      i, j;
-
-    bmp_load(&bmp, file);
+    HIST     hist = {};
+    WU       wu   = {};
+    int      levels[OCTREE_MAX_DEPTH + 1];
+    int      histbits = opts->histbits;
+    int      i, leaves, colors, ret = 0;
+    int64_t  npixel;
+    double   start, tload, thist = 0, toctree, treduce, mse;
+
+    // read the pixels in place from the mapped file, fall back to loading it
+    start = get_time_ms();
+    if (bmp_map(&bmp, &mf, file) < 0) bmp_load(&bmp, file);
+    tload = get_time_ms() - start;
     octree_init(&tree);
-    for (i=0; i<bmp.height; i++) {
-        for (j=0; j<bmp.width; j++) {
-            bmp_getpixel(&bmp, j, i, &r, &g, &b);
-            octree_add_color(&tree, r, g, b);
+    if (histbits > 0) {
+        ret = hist_init(&hist, histbits);
+        if (ret == 0 && opts->sample > 0) {
+            ret = hist_add_sample(&hist, bmp.pdata, bmp.stride, bmp.width, bmp.height, opts->sample);
+        } else if (ret == 0) {
+            ret = hist_add_image_threads(&hist, bmp.pdata, bmp.stride, bmp.width, bmp.height, opts->nthread);
+        }
+        thist = get_time_ms() - start - tload;
+    }
+    if (opts->wu) {
+        if (ret == 0) ret = wu_init(&wu);
+        if (ret == 0 && histbits > 0) wu_add_hist (&wu, &hist);
+        else if (ret == 0)            wu_add_image(&wu, bmp.pdata, bmp.stride, bmp.width, bmp.height);
+    } else if (ret == 0) {
+        if (histbits > 0) ret = octree_add_hist (&tree, &hist);
+        else              ret = octree_add_image(&tree, bmp.pdata, bmp.stride, bmp.width, bmp.height);
+    }
+    if (ret < 0) fprintf(stderr, "failed to allocate memory for the palette !\n");
+    toctree = get_time_ms() - start - tload - thist;
+    leaves  = tree.colors;
+    for (i=0; i<=OCTREE_MAX_DEPTH; i++) levels[i] = tree.count[i];
+    if (opts->wu) {
+        colors = ret == 0 ? wu_getpal(&wu, pal, maxcolor) : 0;
+    } else {
+        octree_reduce(&tree, maxcolor);
+        octree_getpal(&tree, pal);
+        colors = tree.colors < maxcolor ? tree.colors : maxcolor;
+    }
+    treduce = get_time_ms() - start - tload - thist - toctree;
+    npixel  = (int64_t)bmp.width * bmp.height;
+    npixel  = opts->sample > 0 && opts->sample < npixel ? opts->sample : npixel;
+
+    // stats go to stderr, stdout is the palette
+    if (opts->stats) {
+        fprintf(stderr, "stats: load: %dx%d, %.2f ms\n", bmp.width, bmp.height, tload);
+        if (histbits > 0) fprintf(stderr, "stats: histogram: %d bits, %d colors, %d threads, %lld pixels, %.2f ms\n",
+            hist.bits, hist.colors, opts->sample > 0 ? 1 : opts->nthread, (long long)npixel, thist);
+        if (opts->wu) {
+            fprintf(stderr, "stats: wu: %dx%dx%d moments, %d KB, %.2f ms\n", WU_SIDE, WU_SIDE, WU_SIDE,
+                (int)(WU_CELLS * 5 * sizeof(int64_t) / 1024), toctree);
+            fprintf(stderr, "stats: cut: %d colors, %.2f ms\n", colors, treduce);
+        } else {
+            fprintf(stderr, "stats: octree: %d nodes, %d leaves, %d KB arena, %.2f ms\n", tree.nodes, leaves,
+                (int)((int64_t)tree.nblock * (sizeof(OCTNODE) << OCTREE_BLOCK_BITS) / 1024), toctree);
+            for (i=1; i<=OCTREE_MAX_DEPTH; i++) {
+                fprintf(stderr, "stats: level %d: %d nodes, %d after reduce\n", i, levels[i], tree.count[i]);
+            }
+            fprintf(stderr, "stats: reduce: %d colors, %.2f ms\n", tree.colors, treduce);
         }
+        fprintf(stderr, "stats: pixels: %lld, %.2f MPix/s\n", (long long)npixel, thist + toctree > 0 ? npixel / (thist + toctree) / 1000 : 0);
+        fprintf(stderr, "stats: peak memory: %ld KB\n", get_peak_mem_kb());
+        fprintf(stderr, "stats: build: %.2f ms\n", get_time_ms() - start);
+    }
+    if (opts->mse) {
+        start = get_time_ms();
+        mse   = palette_mse(pal, colors, &bmp, opts->nthread);
+        fprintf(stderr, "mse: %.3f per channel, %d colors, %lld of %lld pixels counted, %.2f ms\n",
+            mse, colors, (long long)npixel, (long long)bmp.width * bmp.height, get_time_ms() - start);
     }
-    octree_reduce(&tree, maxcolor);
-    octree_getpal(&tree, pal);
     octree_free(&tree);
-    bmp_free(&bmp);
+    wu_free(&wu);
+    hist_free(&hist);
+    if (mf.data) mapfile_close(&mf);
+    else bmp_free(&bmp);
 }
 
 int main(int argc, char *argv[])
 {
     uint8_t pal[256*3] = {0};
     int     size       =  0;
+    char   *compile    = NULL;
+    int     lutbits    =  0;
+    int     exact      =  0;
+    PALOPTS opts       = { 0, 1 };
     int     i, n;
 
+    // the options may appear anywhere, take them out of the argument list
+    for (i=1, n=1; i<argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) opts.stats = 1;
+        else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) compile = argv[++i];
+        else if (strcmp(argv[i], "--lut") == 0 && i + 1 < argc) lutbits = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--exact") == 0) exact = 1;
+        else if (strcmp(argv[i], "--hist") == 0 && i + 1 < argc) opts.histbits = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) opts.nthread = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) opts.sample = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--mse") == 0) opts.mse = 1;
+        else if (strcmp(argv[i], "--wu") == 0) opts.wu = 1;
+        else argv[n++] = argv[i];
+    }
+    // threads and samples count into histograms, full precision unless --hist says otherwise,
+    // --threads 1 too so the thread count never changes the way the octree is built
+    opts.histbits = (opts.nthread > 0 || opts.sample > 0) && opts.histbits <= 0 ? 8 : opts.histbits;
+    opts.nthread  = opts.nthread > 1 ? opts.nthread : 1;
+    lutbits = lutbits < LUT_MAX_BITS ? lutbits : LUT_MAX_BITS;
+    argc = n;
+
     if (argc < 3) {
         printf("+----------------------+\n");
         printf(" palette util tool v1.0 \n");
@@ -351,6 +367,17 @@ int main(int argc, char *argv[])
         printf(" - create standard color palette, N is the bits number for color component.\n\n");
         printf("palette -p filename N\n");
         printf(" - create best match color palette from bmpfile, N is the max color number.\n\n");
+        printf("palette -l filename\n");
+        printf(" - load a text palette file, to compile it.\n\n");
+        printf("add --stats to print timing, octree and memory statistics to stderr.\n");
+        printf("add --hist N to -p to count the colors first, with N bits per channel (1 to 8),\n");
+        printf("and build the octree from the distinct colors instead of every pixel.\n");
+        printf("add --threads N to -p to count the colors with N threads, implies --hist 8.\n");
+        printf("add --sample N to -p to count only N pixels spread over the image, implies --hist 8.\n");
+        printf("add --mse to -p to print the mean squared error of the palette over every pixel.\n");
+        printf("add --wu to -p to build the palette with wu's quantizer instead of the octree.\n");
+        printf("add --compile file [--lut N] [--exact] to write a compiled palette for dither\n");
+        printf("instead of the text, with the inverse colormap table of N bits if given.\n\n");
         return 0;
     }
 
@@ -373,7 +400,21 @@ int main(int argc, char *argv[])
         else n = atoi(argv[3]);
         n = n < 256 ? n : 256;
         size = n;
-        build_best_match_pal(pal, n, argv[2]);
+        build_best_match_pal(pal, n, argv[2], &opts);
+    }
+
+    if (strcmp(argv[1], "-l") == 0) {
+        size = load_pal_text(pal, argv[2]);
+    }
+
+    if (compile) {
+        if (cpal_save(compile, pal, size, lutbits, exact) < 0) {
+            printf("failed to save compiled palette: %s !\n", compile);
+            return 1;
+        }
+        printf("compiled palette: %s, %d colors, hash %016llx, lut %d bits\n",
+            compile, size, (unsigned long long)cpal_hash(pal, size), lutbits);
+        return 0;
     }
 
     for (i=0; i<size; i++) {
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include "wu.h"
+
+#define WU_INDEX(r, g, b)  (((r) * WU_SIDE + (g)) * WU_SIDE + (b))
+
+#define WU_RED    0
+#define WU_GREEN  1
+#define WU_BLUE   2
+
+// box of cells (r0, r1] x (g0, g1] x (b0, b1]
+typedef struct {
+    int r0, r1;
+    int g0, g1;
+    int b0, b1;
+    int vol;
+} WUBOX;
+
+int wu_init(WU *wu)
+{
+    memset(wu, 0, sizeof(WU));
+    wu->wt = calloc(WU_CELLS * 5, sizeof(int64_t));
+    if (!wu->wt) return -1;
+    wu->mr = wu->wt + WU_CELLS * 1;
+    wu->mg = wu->wt + WU_CELLS * 2;
+    wu->mb = wu->wt + WU_CELLS * 3;
+    wu->m2 = wu->wt + WU_CELLS * 4;
+    return 0;
+}
+
+void wu_free(WU *wu)
+{
+    free(wu->wt);
+    memset(wu, 0, sizeof(WU));
+}
+
+// count pixels of sums sr, sg, sb and sum of squares sq into the cell of r, g, b
+static inline void wu_add(WU *wu, int r, int g, int b, int64_t count, int64_t sr, int64_t sg, int64_t sb, int64_t sq)
+{
+    int i = WU_INDEX((r >> 3) + 1, (g >> 3) + 1, (b >> 3) + 1);
+    wu->wt[i] += count;
+    wu->mr[i] += sr;
+    wu->mg[i] += sg;
+    wu->mb[i] += sb;
+    wu->m2[i] += sq;
+}
+
+void wu_add_image(WU *wu, const uint8_t *data, int stride, int width, int height)
+{
+    const uint8_t *p;
+    int            x, y;
+    for (y=0; y<height; y++, data+=stride) {
+        for (p=data,x=0; x<width; x++, p+=3) wu_add(wu, p[0], p[1], p[2], 1, p[0], p[1], p[2], p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    }
+}
+
+void wu_add_hist(WU *wu, const HIST *hist)
+{
+    const HISTENTRY *e;
+    int              i;
+    for (i=0; i<=hist->mask; i++) {
+        e = &hist->table[i];
+        if (e->key == HIST_EMPTY) continue;
+        wu_add(wu, e->sum[0] / e->count, e->sum[1] / e->count, e->sum[2] / e->count, e->count, e->sum[0], e->sum[1], e->sum[2], e->sq);
+    }
+}
+
+// the histogram to moments summed over [0, r] x [0, g] x [0, b]
+static void wu_moments(WU *wu)
+{
+    int64_t *m[5] = { wu->wt, wu->mr, wu->mg, wu->mb, wu->m2 };
+    int64_t  area[WU_SIDE], line;
+    int      k, r, g, b, i;
+
+    for (k=0; k<5; k++) {
+        for (r=1; r<WU_SIDE; r++) {
+            memset(area, 0, sizeof(area));
+            for (g=1; g<WU_SIDE; g++) {
+                for (line=0,b=1; b<WU_SIDE; b++) {
+                    i          = WU_INDEX(r, g, b);
+                    line      += m[k][i];
+                    area[b]   += line;
+                    m[k][i]    = m[k][WU_INDEX(r - 1, g, b)] + area[b];
+                }
+            }
+        }
+    }
+}
+
+// sum of moment m over the box
+static int64_t wu_vol(const WUBOX *c, const int64_t *m)
+{
+    return m[WU_INDEX(c->r1, c->g1, c->b1)] - m[WU_INDEX(c->r1, c->g1, c->b0)]
+         - m[WU_INDEX(c->r1, c->g0, c->b1)] + m[WU_INDEX(c->r1, c->g0, c->b0)]
+         - m[WU_INDEX(c->r0, c->g1, c->b1)] + m[WU_INDEX(c->r0, c->g1, c->b0)]
+         + m[WU_INDEX(c->r0, c->g0, c->b1)] - m[WU_INDEX(c->r0, c->g0, c->b0)];
+}
+
+// the part of wu_vol that does not depend on the lower end of the box on axis dir
+static int64_t wu_bottom(const WUBOX *c, int dir, const int64_t *m)
+{
+    switch (dir) {
+    case WU_RED:
+        return - m[WU_INDEX(c->r0, c->g1, c->b1)] + m[WU_INDEX(c->r0, c->g1, c->b0)]
+               + m[WU_INDEX(c->r0, c->g0, c->b1)] - m[WU_INDEX(c->r0, c->g0, c->b0)];
+    case WU_GREEN:
+        return - m[WU_INDEX(c->r1, c->g0, c->b1)] + m[WU_INDEX(c->r1, c->g0, c->b0)]
+               + m[WU_INDEX(c->r0, c->g0, c->b1)] - m[WU_INDEX(c->r0, c->g0, c->b0)];
+    default:
+        return - m[WU_INDEX(c->r1, c->g1, c->b0)] + m[WU_INDEX(c->r1, c->g0, c->b0)]
+               + m[WU_INDEX(c->r0, c->g1, c->b0)] - m[WU_INDEX(c->r0, c->g0, c->b0)];
+    }
+}
+
+// the rest of wu_vol with the upper end of the box on axis dir at pos
+static int64_t wu_top(const WUBOX *c, int dir, int pos, const int64_t *m)
+{
+    switch (dir) {
+    case WU_RED:
+        return m[WU_INDEX(pos, c->g1, c->b1)] - m[WU_INDEX(pos, c->g1, c->b0)]
+             - m[WU_INDEX(pos, c->g0, c->b1)] + m[WU_INDEX(pos, c->g0, c->b0)];
+    case WU_GREEN:
+        return m[WU_INDEX(c->r1, pos, c->b1)] - m[WU_INDEX(c->r1, pos, c->b0)]
+             - m[WU_INDEX(c->r0, pos, c->b1)] + m[WU_INDEX(c->r0, pos, c->b0)];
+    default:
+        return m[WU_INDEX(c->r1, c->g1, pos)] - m[WU_INDEX(c->r1, c->g0, pos)]
+             - m[WU_INDEX(c->r0, c->g1, pos)] + m[WU_INDEX(c->r0, c->g0, pos)];
+    }
+}
+
+// weighted variance of the box, times its pixel count
+static double wu_var(WU *wu, const WUBOX *c)
+{
+    double dr = wu_vol(c, wu->mr);
+    double dg = wu_vol(c, wu->mg);
+    double db = wu_vol(c, wu->mb);
+    double w  = wu_vol(c, wu->wt);
+    return w > 0 ? wu_vol(c, wu->m2) - (dr * dr + dg * dg + db * db) / w : 0;
+}
+
+// best cut of the box on axis dir, the one that maximizes the sum over both
+// halves of |sum|^2 / count, which minimizes their summed variance
+static double wu_maximize(WU *wu, const WUBOX *c, int dir, int first, int last, int *cut, const int64_t whole[4])
+{
+    int64_t base[4], half[4];
+    double  max = 0, temp;
+    int     i;
+
+    base[0] = wu_bottom(c, dir, wu->mr);
+    base[1] = wu_bottom(c, dir, wu->mg);
+    base[2] = wu_bottom(c, dir, wu->mb);
+    base[3] = wu_bottom(c, dir, wu->wt);
+    *cut    = -1;
+    for (i=first; i<last; i++) {
+        half[0] = base[0] + wu_top(c, dir, i, wu->mr);
+        half[1] = base[1] + wu_top(c, dir, i, wu->mg);
+        half[2] = base[2] + wu_top(c, dir, i, wu->mb);
+        half[3] = base[3] + wu_top(c, dir, i, wu->wt);
+        if (half[3] == 0 || half[3] == whole[3]) continue; // one side empty
+        temp  = ((double)half[0] * half[0] + (double)half[1] * half[1] + (double)half[2] * half[2]) / half[3];
+        half[0] = whole[0] - half[0];
+        half[1] = whole[1] - half[1];
+        half[2] = whole[2] - half[2];
+        half[3] = whole[3] - half[3];
+        temp += ((double)half[0] * half[0] + (double)half[1] * half[1] + (double)half[2] * half[2]) / half[3];
+        if (temp > max) {
+            max  = temp;
+            *cut = i;
+        }
+    }
+    return max;
+}
+
+// cut box a in two, the upper part goes to b, returns 0 if it can not be cut
+static int wu_cut(WU *wu, WUBOX *a, WUBOX *b)
+{
+    int64_t whole[4];
+    double  maxr, maxg, maxb;
+    int     cutr, cutg, cutb, dir;
+
+    whole[0] = wu_vol(a, wu->mr);
+    whole[1] = wu_vol(a, wu->mg);
+    whole[2] = wu_vol(a, wu->mb);
+    whole[3] = wu_vol(a, wu->wt);
+    maxr = wu_maximize(wu, a, WU_RED  , a->r0 + 1, a->r1, &cutr, whole);
+    maxg = wu_maximize(wu, a, WU_GREEN, a->g0 + 1, a->g1, &cutg, whole);
+    maxb = wu_maximize(wu, a, WU_BLUE , a->b0 + 1, a->b1, &cutb, whole);
+    if (maxr >= maxg && maxr >= maxb) {
+        dir = WU_RED;
+        if (cutr < 0) return 0;
+    } else {
+        dir = maxg >= maxb ? WU_GREEN : WU_BLUE;
+    }
+
+    *b = *a;
+    switch (dir) {
+    case WU_RED  : b->r0 = a->r1 = cutr; break;
+    case WU_GREEN: b->g0 = a->g1 = cutg; break;
+    case WU_BLUE : b->b0 = a->b1 = cutb; break;
+    }
+    a->vol = (a->r1 - a->r0) * (a->g1 - a->g0) * (a->b1 - a->b0);
+    b->vol = (b->r1 - b->r0) * (b->g1 - b->g0) * (b->b1 - b->b0);
+    return 1;
+}
+
+int wu_getpal(WU *wu, uint8_t *pal, int maxcolor)
+{
+    WUBOX   box[256];
+    double  vv [256], temp;
+    int64_t w;
+    int     n, next, i, k;
+
+    maxcolor = maxcolor < 1 ? 1 : maxcolor < 256 ? maxcolor : 256;
+    wu_moments(wu);
+    box[0].r0 = box[0].g0 = box[0].b0 = 0;
+    box[0].r1 = box[0].g1 = box[0].b1 = WU_SIDE - 1;
+    vv [0]    = 0;
+    for (n=1,next=0; n<maxcolor; ) {
+        if (wu_cut(wu, &box[next], &box[n])) {
+            vv[next] = box[next].vol > 1 ? wu_var(wu, &box[next]) : 0;
+            vv[n]    = box[n   ].vol > 1 ? wu_var(wu, &box[n   ]) : 0;
+            n++;
+        } else {
+            vv[next] = 0; // can not be cut, never try it again
+        }
+        // the next box to cut is the one of the largest variance
+        for (next=0,temp=vv[0],k=1; k<n; k++) {
+            if (vv[k] > temp) {
+                temp = vv[k];
+                next = k;
+            }
+        }
+        if (temp <= 0) break;
+    }
+
+    for (i=0,k=0; i<n; i++) {
+        w = wu_vol(&box[i], wu->wt);
+        if (w == 0) continue; // the first box of an empty image
+        pal[k * 3 + 0] = wu_vol(&box[i], wu->mr) / w;
+        pal[k * 3 + 1] = wu_vol(&box[i], wu->mg) / w;
+        pal[k * 3 + 2] = wu_vol(&box[i], wu->mb) / w;
+        k++;
+    }
+    return k;
+}
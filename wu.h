@@ -0,0 +1,33 @@
+#ifndef __WU_H__
+#define __WU_H__
+
+#include <stdint.h>
+#include "colorhist.h"
+
+// wu's color quantizer, the colors are counted in a 33x33x33 histogram of
+// 5 bits per channel (cell 0 of each axis stays empty), turned into cumulative
+// moments, then the box of the largest variance is cut in two where the
+// variance drops most, until maxcolor boxes. every box sum is 8 lookups in the
+// moments, so the time after the histogram does not depend on the image size.
+#define WU_SIDE   33
+#define WU_CELLS  (WU_SIDE * WU_SIDE * WU_SIDE)
+
+typedef struct {
+    int64_t *wt; // pixels
+    int64_t *mr; // r, g and b sums
+    int64_t *mg;
+    int64_t *mb;
+    int64_t *m2; // sum of r * r + g * g + b * b
+} WU;
+
+int  wu_init     (WU *wu); // -1 if out of memory
+void wu_free     (WU *wu);
+void wu_add_image(WU *wu, const uint8_t *data, int stride, int width, int height);
+// the entries of a histogram, each one in the cell of its mean color with its own sums
+void wu_add_hist (WU *wu, const HIST *hist);
+
+// builds at most maxcolor (1 to 256) colors into pal, returns the number of colors,
+// the moments are made cumulative, so no color may be added after it.
+int  wu_getpal   (WU *wu, uint8_t *pal, int maxcolor);
+
+#endif